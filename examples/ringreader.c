@@ -0,0 +1,65 @@
+/*
+  Copyright 2012-2014 Christopher E. Miller
+  License: GPLv2, see LICENSE file.
+*/
+
+/*	Prints the events irccmd writes to its shared memory ring:
+		./irccmd irc.example.net -ring=/irccmd
+		cc -O2 -I../src -o ringreader ringreader.c -lrt
+		./ringreader /irccmd
+	Events are read in place, without copying them out of the ring.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "ircring.h"
+
+
+int main(int argc, char **argv)
+{
+	IrcRingReader r;
+	IrcRingEvent ev;
+	const char *name = argc > 1 ? argv[1] : "/irccmd";
+	unsigned long long lost = 0;
+	if(-1 == ircring_open(&r, name))
+	{
+		perror(name);
+		return 1;
+	}
+	for(;;)
+	{
+		int i;
+		int got = ircring_next(&r, &ev);
+		if(!got)
+		{
+			struct timespec ts = { 0, 1000000 };
+			fflush(stdout);
+			nanosleep(&ts, NULL); /* Nothing yet. */
+			continue;
+		}
+		if(got < 0)
+			continue; /* Fell behind, r.lost is updated with the next event. */
+		/* Format into a buffer first, the event can be overwritten while we look. */
+		{
+			char line[8192];
+			int n = snprintf(line, sizeof(line), "%llu %.3f %.*s %.*s %.*s",
+				(unsigned long long)ev.seq, ev.time,
+				(int)ev.networklen, ev.network, (int)ev.sourcelen, ev.source,
+				(int)ev.commandlen, ev.command);
+			for(i = 0; i < ev.nparams && n > 0 && n < (int)sizeof(line); i++)
+				n += snprintf(line + n, sizeof(line) - n, " [%.*s]", (int)ev.paramlens[i], ev.params[i]);
+			if(!ircring_valid(&r, &ev))
+				continue; /* Overwritten while formatting, skip it. */
+			puts(line);
+		}
+		if(r.lost != lost)
+		{
+			lost = r.lost;
+			fprintf(stderr, "ringreader: %llu events lost so far\n", lost);
+		}
+	}
+	ircring_close(&r);
+	return 0;
+}
@@ -0,0 +1,275 @@
+-- Copyright 2012-2014 Christopher E. Miller
+-- License: GPLv2, see LICENSE file.
+
+-- Coroutine scheduler for scripts, resumed from SelectManagerBase:loop().
+-- async(function()
+-- 	client:sendLine("WHOIS " .. nick)
+-- 	local prefix, cmd, params = await_numeric(client, { "311", "401" }, 10)
+-- 	sleep(5)
+-- end)
+-- The await functions return nil, "timeout" if the timeout (seconds) elapses first.
+-- Each waiting coroutine only costs its entry in the schedule, a binary heap,
+-- so adding, waking and timing out a waiter are O(log n).
+
+
+require("irccmd_internal")
+require("utils")
+
+
+local baseTime = internal.milliseconds() -- Monotonic, setting the clock doesn't move sleepers.
+local schedule = {} -- Heap of waiters with a timeout, soonest .at first; waiter.heapIndex is its place.
+local scheduleSeq = 0 -- Waiters with the same .at wake in the order they were scheduled.
+
+local function now()
+	return internal.milliseconds_diff(baseTime, internal.milliseconds())
+end
+
+local function sooner(a, b)
+	return a.at < b.at or (a.at == b.at and a.seq < b.seq)
+end
+
+local function heapSet(i, waiter)
+	schedule[i] = waiter
+	waiter.heapIndex = i
+end
+
+local function siftUp(i)
+	local waiter = schedule[i]
+	while i > 1 do
+		local parent = math.floor(i / 2)
+		if not sooner(waiter, schedule[parent]) then
+			break
+		end
+		heapSet(i, schedule[parent])
+		i = parent
+	end
+	heapSet(i, waiter)
+end
+
+local function siftDown(i)
+	local waiter, n = schedule[i], #schedule
+	while true do
+		local child = i * 2
+		if child > n then
+			break
+		end
+		if child < n and sooner(schedule[child + 1], schedule[child]) then
+			child = child + 1
+		end
+		if not sooner(schedule[child], waiter) then
+			break
+		end
+		heapSet(i, schedule[child])
+		i = child
+	end
+	heapSet(i, waiter)
+end
+
+-- Takes the waiter out of the schedule, if it's in it.
+local function unschedule(waiter)
+	local i = waiter.heapIndex
+	if not i then
+		return
+	end
+	waiter.heapIndex = nil
+	local n = #schedule
+	local last = schedule[n]
+	schedule[n] = nil
+	if i < n then
+		heapSet(i, last)
+		siftUp(i)
+		siftDown(last.heapIndex)
+	end
+end
+
+local function current()
+	local co = coroutine.running()
+	if not co then
+		error("Only an async function can wait", 3)
+	end
+	return co
+end
+
+local function resume(co, ...)
+	local ok, err = coroutine.resume(co, ...)
+	if not ok then
+		error(debug.traceback(co, err), 0)
+	end
+end
+
+-- Resumes the waiter once, either by its event or its timeout.
+local function wake(waiter, ...)
+	if waiter.done then
+		return false
+	end
+	waiter.done = true
+	unschedule(waiter) -- Woken by its event, the timeout is no longer needed.
+	if waiter.cancel then
+		waiter.cancel(waiter)
+	end
+	resume(waiter.co, ...)
+	return true
+end
+
+local function scheduleAt(waiter, seconds)
+	scheduleSeq = scheduleSeq + 1
+	waiter.at = now() + seconds * 1000
+	waiter.seq = scheduleSeq
+	schedule[#schedule + 1] = waiter
+	siftUp(#schedule)
+end
+
+-- Waits for wake, or the timeout.
+local function await(waiter, timeout)
+	if timeout then
+		scheduleAt(waiter, timeout)
+	end
+	return coroutine.yield()
+end
+
+
+-- Runs f(...) as a coroutine, starting right away; returns the coroutine.
+function async(f, ...)
+	local co = coroutine.create(f)
+	resume(co, ...)
+	return co
+end
+
+function sleep(seconds)
+	local waiter = { co = current() }
+	scheduleAt(waiter, seconds)
+	waiter.timeoutResult = true
+	return coroutine.yield()
+end
+
+
+-- Waits for the client to receive one of the commands, such as numerics.
+-- commands is a command or an array of them; returns prefix, cmd, params.
+function await_numeric(client, commands, timeout)
+	if type(commands) ~= "table" then
+		commands = { commands }
+	end
+	local waiter = { co = current() }
+	local waiting = asyncClientWaiters(client)
+	for i = 1, #commands do
+		local cmd = tostring(commands[i]):upper()
+		waiting[cmd] = waiting[cmd] or {}
+		table.insert(waiting[cmd], waiter)
+	end
+	waiter.cancel = function(waiter)
+		for i = 1, #commands do
+			local list = waiting[tostring(commands[i]):upper()]
+			for j = 1, #list do
+				if list[j] == waiter then
+					table.remove(list, j)
+					break
+				end
+			end
+		end
+	end
+	return await(waiter, timeout)
+end
+
+-- Waits for a PRIVMSG to target (a channel, or our nick for private messages),
+-- from nick if given; returns the text and the sender's nick.
+function await_line(client, target, nick, timeout)
+	local waiter = { co = current() }
+	local waiting = asyncClientWaiters(client)
+	waiter.match = function(prefix, params)
+		if client.strcmp(params[1], target) ~= 0 then
+			return false
+		end
+		return not nick or client.strcmp(nickFromSource(prefix), nick) == 0
+	end
+	waiting.lines = waiting.lines or {}
+	table.insert(waiting.lines, waiter)
+	waiter.cancel = function(waiter)
+		for j = 1, #waiting.lines do
+			if waiting.lines[j] == waiter then
+				table.remove(waiting.lines, j)
+				break
+			end
+		end
+	end
+	return await(waiter, timeout)
+end
+
+-- Sends a query and waits for its replies, see IrcClient:query; returns replies, err.
+function await_query(client, line, timeout)
+	local waiter = { co = current() }
+	client:query(line, function(replies, err)
+		wake(waiter, replies, err)
+	end, timeout)
+	return await(waiter)
+end
+
+-- Waits for the socket to be readable; the socket must not already be in the manager.
+function await_readable(sock, timeout)
+	local waiter = { co = current() }
+	local watcher = {
+		_sock = sock,
+		valid = function() return true end,
+		needRead = function() return true end,
+		needWrite = function() return false end,
+		onCanRead = function()
+			wake(waiter, true)
+			return "-"
+		end,
+	}
+	waiter.cancel = function(waiter)
+		manager:remove(watcher)
+	end
+	manager:add(watcher)
+	return await(waiter, timeout)
+end
+
+
+-- Returns the client's table of waiting coroutines, hooking the client the first time.
+function asyncClientWaiters(client)
+	if not client._asyncWaiters then
+		client._asyncWaiters = {}
+		client.on["*"] = asyncOnCommand
+	end
+	return client._asyncWaiters
+end
+
+function asyncOnCommand(client, prefix, cmd, params)
+	local waiting = client._asyncWaiters
+	local list = waiting[cmd]
+	if list and #list > 0 then
+		waiting[cmd] = {}
+		for i = 1, #list do
+			wake(list[i], prefix, cmd, params)
+		end
+	end
+	if cmd == "PRIVMSG" and waiting.lines then
+		local i = 1
+		while waiting.lines[i] do
+			local waiter = waiting.lines[i]
+			if waiter.match(prefix or "", params) then
+				wake(waiter, params[#params], nickFromSource(prefix or ""))
+			else
+				i = i + 1
+			end
+		end
+	end
+end
+
+
+-- Called by SelectManagerBase:loop(), resumes the coroutines whose time came.
+-- Returns microseconds until the next one, or nil if none.
+function async_tick()
+	local t = now()
+	while schedule[1] and schedule[1].at <= t do
+		local waiter = schedule[1]
+		unschedule(waiter)
+		if waiter.timeoutResult then
+			wake(waiter, true)
+		else
+			wake(waiter, nil, "timeout")
+		end
+	end
+	if schedule[1] then
+		return math.max(0, (schedule[1].at - t) * 1000)
+	end
+end
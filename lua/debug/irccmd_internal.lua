@@ -56,6 +56,11 @@ if true then
 		return 1000
 	end
 
+	-- timestamp() is seconds since the epoch, with a fraction.
+	internal.timestamp = function()
+		return os.time() + 0.5
+	end
+
 	local function print_args(f, ...)
 		local n = select('#', ...)
 		for i = 1, n do
@@ -74,6 +79,25 @@ if true then
 		print_args(io.stderr, ...)
 	end
 
+	-- There is no shared memory ring when debugging.
+	internal.ring_open = function(name, bytes)
+		return nil, "No ring when debugging"
+	end
+	internal.ring_write = function(prefix, cmd, params, tags, time, network)
+		return false
+	end
+	internal.ring_close = function()
+	end
+
+	-- Output is not buffered when debugging.
+	internal.console_buffer = function(latency, flushBytes, maxBytes)
+		assert(not latency or type(latency) == "number")
+	end
+
+	internal.console_flush = function(force)
+		return nil
+	end
+
 	-- line = irc_input(line_data)
 	internal.irc_input = function(s)
 		return s
@@ -81,16 +105,172 @@ if true then
 
 	debugPPRIVMSG = debugPPRIVMSG or "Hey (test data)"
 
-	-- (prefix, cmd, params) = irc_input(line)
-	-- params is a table; prefix may be nil if no prefix.
+	-- (prefix, cmd, params, tags, numeric) = irc_parse(line)
+	-- params is a table; prefix may be nil if no prefix; tags is nil if none.
+	-- cmd is uppercase; numeric is the integer code of a numeric cmd, or nil.
 	internal.irc_parse = function(s)
 		if s:find("^:server%.name 001 ") then
-			return "server.name", "001", { "SelfNick", "Welcome (test data)" }
+			return "server.name", "001", { "SelfNick", "Welcome (test data)" }, nil, 1
 		end
 		return "OtherUser!hello@hi.com", "PRIVMSG", { "#foo", debugPPRIVMSG }
 		-- return "server.name", "318", { "SomeUser1", "OtherUser", "End of /WHOIS list." }
 	end
 
+	-- value = irc_tag(tags, key)
+	internal.irc_tag = function(tags, key)
+		if not tags then return nil end
+		for tag in tags:gmatch("[^;]+") do
+			local k, v = tag:match("^([^=]*)=?(.*)$")
+			if k == key then
+				local esc = { [":"] = ";", s = " ", r = "\r", n = "\n" }
+				return (v:gsub("\\(.?)", function(c) return esc[c] or c end))
+			end
+		end
+		return nil
+	end
+
+	-- data = irc_encode(format, prefix, cmd, params [, tags [, time [, network]]])
+	-- Only json when debugging; the source parts and tags are left out.
+	internal.irc_encode = function(format, prefix, cmd, params, tags, time, network)
+		local function str(s)
+			return '"' .. tostring(s):gsub('[%c"\\]', function(c)
+				return string.format("\\u%04x", c:byte())
+			end) .. '"'
+		end
+		local ps = {}
+		for i = 1, #params do
+			ps[i] = type(params[i]) == "number" and tostring(params[i]) or str(params[i])
+		end
+		return "{" .. (time and '"time":' .. string.format("%.6f", time) .. "," or "")
+			.. (network and '"network":' .. str(network) .. "," or "")
+			.. (prefix and '"source":' .. str(prefix) .. "," or "")
+			.. '"command":' .. str(cmd) .. ',"params":[' .. table.concat(ps, ",") .. "]}\n"
+	end
+
+	internal.irc_names = function(nicklist, names, prefixSymbols, prefixModes, tolower)
+		tolower = tolower or internal.tolower_rfc1459
+		local count, sources = 0, nil
+		for xnick in names:gmatch("[^ ]+") do
+			local i = 1
+			while i <= xnick:len() and prefixSymbols:find(xnick:sub(i, i), 1, true) do
+				i = i + 1
+			end
+			local syms, nick = xnick:sub(1, i - 1), xnick:sub(i)
+			local modes = ""
+			for i = 1, prefixSymbols:len() do
+				if syms:find(prefixSymbols:sub(i, i), 1, true) then
+					modes = modes .. prefixModes:sub(i, i)
+				end
+			end
+			if nick:find("!", 1, true) then
+				sources = sources or {}
+				table.insert(sources, nick)
+				nick = nick:match("^[^!]*")
+			end
+			local key = tolower(nick)
+			local entry = rawget(nicklist, key) or {}
+			rawset(nicklist, key, entry)
+			entry.nick = nick
+			entry.modes = modes
+			count = count + 1
+		end
+		return count, sources
+	end
+
+	internal.irc_mode_apply = function(state, members, params, first, chanmodes, prefixModes, tolower)
+		chanmodes = chanmodes or "beI,k,l,imnpst"
+		prefixModes = prefixModes or "ov"
+		tolower = tolower or internal.tolower_rfc1459
+		local types = {}
+		local t = 1
+		for ch in chanmodes:gmatch(".") do
+			if ch == "," then t = t + 1 else types[ch] = ("ABCD"):sub(t, t) end
+		end
+		for ch in prefixModes:gmatch(".") do types[ch] = "P" end
+		state.modes = state.modes or {}
+		state.lists = state.lists or {}
+		local adding, iparam, count = true, first + 1, 0
+		for m in params[first]:gmatch(".") do
+			if m == "+" or m == "-" then
+				adding = m == "+"
+			else
+				local mt = types[m]
+				local param
+				if mt == "A" or mt == "B" or mt == "P" or (mt == "C" and adding) then
+					param = params[iparam]
+					if not param then break end
+					iparam = iparam + 1
+				end
+				if mt == "A" then
+					state.lists[m] = state.lists[m] or {}
+					state.lists[m][param] = adding or nil
+				elseif mt == "P" then
+					local entry = members and rawget(members, tolower(param))
+					if entry then
+						local modes = ""
+						for pm in prefixModes:gmatch(".") do
+							if pm == m then
+								if adding then modes = modes .. pm end
+							elseif (entry.modes or ""):find(pm, 1, true) then
+								modes = modes .. pm
+							end
+						end
+						entry.modes = modes
+					end
+				else
+					state.modes[m] = adding and (param or true) or nil
+				end
+				count = count + 1
+			end
+		end
+		return count
+	end
+
+	-- t = template(syntax), see t:render(values [, client]), t:values(params [, values]), t:slots()
+	internal.template = function(syntax)
+		local t = {}
+		t.render = function(t, values, client)
+			return (syntax:gsub("%{([^%}]*)%}", function(rawname)
+				local name = rawname:match("^(.-)%.%.%.$") or rawname
+				local v
+				if name == "nick" then
+					v = values.nick or (values.source and nickFromSource(values.source))
+				elseif name == "chan" or name == "channel" then
+					v = values.channel or values.chan
+						or (client and values.target and client:channelNameFromTarget(values.target))
+				elseif name == "msg" or name == "message" then
+					v = values.msg or values.message
+				else
+					v = values[name]
+				end
+				return v or (name ~= rawname and "" or "{" .. rawname .. "}")
+			end))
+		end
+		t.values = function(t, params, values)
+			values = values or {}
+			local i = 1
+			for rawname in syntax:gmatch("%{([^%}]*)%}") do
+				local name = rawname:match("^(.-)%.%.%.$")
+				if name and i < #params then
+					values[name] = table.concat(params, " ", i)
+					i = #params + 1
+				else
+					values[name or rawname] = params[i]
+					i = i + 1
+				end
+			end
+			return values
+		end
+		t.slots = function(t)
+			local slots = {}
+			for rawname in syntax:gmatch("%{([^%}]*)%}") do
+				table.insert(slots, rawname)
+			end
+			return slots
+		end
+		return t
+	end
+
 	internal.compare_ascii = function(s1, s2)
 		if s1 == s2 then return 0 end
 		return s
@@ -114,6 +294,75 @@ if true then
 		return 0, 0
 	end
 
+	internal.coco_stacks = function(poolmax)
+		return nil -- no coco stack pool.
+	end
+
+	internal.histogram = function()
+		local n, sum, low, high = 0, 0, 0, 0
+		local h = {}
+		h.record = function(h, v, count)
+			count = count or 1
+			if n == 0 or v < low then low = v end
+			if v > high then high = v end
+			n = n + count
+			sum = sum + v * count
+		end
+		h.percentile = function(h, p) return high end -- not tracked here.
+		h.count = function(h) return n end
+		h.min = function(h) return low end
+		h.max = function(h) return high end
+		h.mean = function(h) return n > 0 and sum / n or 0 end
+		h.stats = function(h)
+			return { count = n, min = low, max = high, mean = h:mean(),
+				p50 = high, p90 = high, p99 = high }
+		end
+		h.reset = function(h)
+			n, sum, low, high = 0, 0, 0, 0
+		end
+		return h
+	end
+
+	-- Workers are not started when debugging, mail is only delivered to yourself.
+	local mailboxes = {}
+	internal.worker_start = function(id, argv, path, cpath)
+		assert(type(id) == "number" and id > 0)
+		assert(type(argv) == "table")
+		return nil, "Workers are not available when debugging"
+	end
+	internal.worker_join = function(id)
+	end
+	internal.worker_mailbox = function(id)
+		mailboxes[id] = mailboxes[id] or { msgs = {}, froms = {} }
+		return 1000 + id
+	end
+	internal.worker_send = function(to, from, data)
+		assert(type(data) == "string")
+		internal.worker_mailbox(to)
+		table.insert(mailboxes[to].msgs, data)
+		table.insert(mailboxes[to].froms, from)
+		return true
+	end
+	internal.worker_receive = function(id, max)
+		local mb = mailboxes[id]
+		if not mb or #mb.msgs == 0 then
+			return nil
+		end
+		mailboxes[id] = nil
+		return mb.msgs, mb.froms
+	end
+
+	-- Jobs run right away when debugging, as if the pool finished them.
+	internal.job_pool_start = function(nthreads, path, cpath)
+		return nthreads
+	end
+	internal.job_submit = function(owner, id, module, func, args)
+		local result = jobRun(id, module, func, args)
+		return internal.worker_send(owner, WORKER_JOBS, result)
+	end
+	internal.job_pool_stop = function()
+	end
+
 	internal.socket_connect = function(addr, port, stype, family, socketCreatedFunc)
 		if type(stype) == "function" then
 			socketCreatedFunc = stype
@@ -175,6 +424,12 @@ if true then
 		assert(seconds == false or (type(seconds) == "number" and seconds >= 0))
 	end
 
+	internal.socket_keepalive = function(sock, idle, interval, count, userTimeoutMs)
+		assert(sock == 71)
+		assert(idle == false or (type(idle) == "number" and idle > 0))
+		return true
+	end
+
 	internal.socket_shutdown = function(sock, how)
 		assert(sock == 71)
 		assert(how:upper() == "RECEIVE" or how:upper() == "SEND" or how:upper() == "BOTH")
@@ -192,20 +447,22 @@ if true then
 		assert(not flags or type(flags) == "string")
 		assert(not maxBytes or type(maxBytes) == "number")
 		return ":server.name 001 SelfNick :Welcome (test data)\r\n"
-			.. ":OtherUser!hello@hi.com PRIVMSG #foo :" .. debugPPRIVMSG .. "\r\n"
+			.. ":OtherUser!hello@hi.com PRIVMSG #foo :" .. debugPPRIVMSG .. "\r\n",
+			internal.timestamp()
 	end
 
 	local selectcount = 0
 
-	internal.socket_select = function(sockets, microseconds)
+	internal.socket_select = function(sockets, microseconds, stdinLines)
 		assert(type(sockets) == "table")
 		assert(not microseconds or type(microseconds) == "number")
+		assert(not stdinLines or type(stdinLines) == "number")
 		selectcount = selectcount + 1
 		if selectcount <= 2 then
 			if sockets[71] then
 				if sockets["stdin"] and selectcount == 2 then
 					-- return { ["stdin"] = "/echo Test echo from console!\r\n" }
-					return { ["stdin"] = "#foo Test message from console!\r\n" }
+					return { ["stdin"] = { "#foo Test message from console!\r\n" } }
 				end
 				return { [71] = sockets[71] }
 			end
@@ -0,0 +1,218 @@
+-- Copyright 2012-2014 Christopher E. Miller
+-- License: GPLv2, see LICENSE file.
+
+-- Parallel event dispatch for one busy connection.
+-- A Dispatcher runs lanes, threads with their own Lua state which load the lane scripts.
+-- Channel events are hashed by channel (or by sender if not to a channel) onto one lane,
+-- so each channel's events stay in order; connection wide events go to every lane.
+-- Lane scripts see a LaneClient for each dispatched client through clientAdded,
+-- and use client.on[...] and client:sendLine as usual; lines are sent by the connection.
+-- The connection still handles every event itself as well.
+
+
+require("workers")
+require("ircprotocol")
+
+
+clientAdded = clientAdded or event()
+
+dispatchers = dispatchers or {} -- Running Dispatchers are keys.
+dispatchNextKey = dispatchNextKey or 0 -- Identifies clients to the lanes.
+
+-- Commands hashed onto a lane, by the channel in params[1].
+dispatchChannelCommands = dispatchChannelCommands or {
+	PRIVMSG = true, NOTICE = true, JOIN = true, PART = true,
+	KICK = true, TOPIC = true, MODE = true,
+}
+
+-- Commands sent to every lane.
+dispatchGlobalCommands = dispatchGlobalCommands or {
+	["001"] = true, ["005"] = true, NICK = true, QUIT = true, ERROR = true,
+	NETSPLIT = true, NETJOIN = true, -- Folded QUITs and JOINs, see IrcClient:_netStorm.
+}
+
+
+Dispatcher = class()
+
+-- Starts nlanes lanes, each requiring the scripts (module names or .lua files).
+function Dispatcher:init(nlanes, scripts)
+	self.lanes = {}
+	self.clients = {}
+	workerListen()
+	for i = 1, nlanes do
+		local id = assert(internal.worker_start(0, 'require("dispatch") dispatchLaneLoop()',
+			package.path, package.cpath))
+		self.lanes[i] = id
+		internal.worker_send(id, worker_id, workerSerialize("_laneInit", scripts or {}))
+	end
+	dispatchers[self] = true
+end
+
+-- Dispatches the client's events from now on.
+function Dispatcher:addClient(client)
+	dispatchNextKey = dispatchNextKey + 1
+	local key = dispatchNextKey
+	self.clients[key] = client
+	client.dispatch = self
+	client._dispatchKey = key
+	local state = workerSerialize("_laneClient", key, {
+		nick = client._nick,
+		support = client.support,
+		prefixModes = client.prefixModes,
+		prefixSymbols = client.prefixSymbols,
+	})
+	for i = 1, #self.lanes do
+		internal.worker_send(self.lanes[i], worker_id, state)
+	end
+end
+
+function Dispatcher:removeClient(client)
+	local key = client._dispatchKey
+	if key and self.clients[key] == client then
+		self.clients[key] = nil
+		client.dispatch = nil
+		client._dispatchKey = nil
+		self:_broadcast("_laneRemove", key)
+	end
+end
+
+function Dispatcher:_broadcast(...)
+	local data = workerSerialize(...)
+	for i = 1, #self.lanes do
+		internal.worker_send(self.lanes[i], worker_id, data)
+	end
+end
+
+-- Called from IrcClient:onCommand.
+function Dispatcher:route(client, prefix, cmd, params, numeric)
+	if dispatchGlobalCommands[cmd] then
+		self:_broadcast("_laneEvent", client._dispatchKey, prefix, cmd, params, numeric)
+	elseif dispatchChannelCommands[cmd] then
+		local key = params[1] and client.support and client:channelNameFromTarget(params[1])
+		key = key or nickFromSource(prefix or "")
+		key = (client.tolower or string.lower)(key)
+		local lane = self.lanes[workerHash(key) % #self.lanes + 1]
+		internal.worker_send(lane, worker_id,
+			workerSerialize("_laneEvent", client._dispatchKey, prefix, cmd, params, numeric))
+	end
+end
+
+-- Stops the lanes and waits for them.
+function Dispatcher:stop()
+	for key, client in pairs(self.clients) do
+		client.dispatch = nil
+		client._dispatchKey = nil
+	end
+	self.clients = {}
+	self:_broadcast("_stopWorker")
+	for i = 1, #self.lanes do
+		internal.worker_join(self.lanes[i])
+	end
+	self.lanes = {}
+	dispatchers[self] = nil
+end
+
+function stopDispatchers()
+	for d in pairs(dispatchers) do
+		d:stop()
+	end
+end
+
+-- Lines sent by lanes.
+workerCommands._laneSend = function(from, key, line)
+	for d in pairs(dispatchers) do
+		local client = d.clients[key]
+		if client then
+			client:sendLine(line)
+			return
+		end
+	end
+end
+
+
+-- The client seen by lane scripts; sends through the connection's thread.
+LaneClient = class(IrcClient)
+
+function LaneClient:init(owner, key, state)
+	IrcClient.init(self)
+	self._laneOwner = owner
+	self._dispatchKey = key
+	self._nick = state.nick
+	self.support = state.support
+	self.prefixModes = state.prefixModes
+	self.prefixSymbols = state.prefixSymbols
+	local casemapping = self.support and self.support["CASEMAPPING"]
+	if casemapping == "ascii" then
+		self.strcmp = internal.compare_ascii
+		self.tolower = internal.tolower_ascii
+	elseif casemapping == "strict-rfc1459" then
+		self.strcmp = internal.compare_strict_rfc1459
+		self.tolower = internal.tolower_strict_rfc1459
+	elseif casemapping then
+		self.strcmp = internal.compare_rfc1459
+		self.tolower = internal.tolower_rfc1459
+	end
+	rawset(self.on, "/PING", nil) -- The connection answers.
+	self._onVersion = self._onVersion + 1
+end
+
+function LaneClient:sendLine(line)
+	return internal.worker_send(self._laneOwner, worker_id, workerSerialize("_laneSend", self._dispatchKey, line))
+end
+
+LaneClient.sendLineNow = LaneClient.sendLine
+
+function LaneClient:sendLinesNow(lines)
+	for i = 1, #lines do
+		self:sendLine(lines[i])
+	end
+end
+
+
+-- Runs in the lane threads.
+function dispatchLaneLoop()
+	require("sockets")
+	require("timers")
+	laneClients = {}
+	manager = SelectManager()
+	workerListen()
+	while true do
+		local ok, again = xpcall(function() return manager:loop() end, debug.traceback)
+		if ok and not again then
+			break
+		end
+		if not ok then
+			io.stderr:write("Dispatch lane ", worker_id, ": ", again, "\n")
+		end
+	end
+end
+
+workerCommands._laneInit = function(from, scripts)
+	for i = 1, #scripts do
+		require(scripts[i]:match("^(.*)%.lua$") or scripts[i])
+	end
+end
+
+workerCommands._laneClient = function(from, key, state)
+	local client = LaneClient(from, key, state)
+	laneClients[key] = client
+	clientAdded(client)
+end
+
+workerCommands._laneRemove = function(from, key)
+	local client = laneClients[key]
+	laneClients[key] = nil
+	if client and clientRemoved then
+		clientRemoved(client)
+	end
+end
+
+workerCommands._laneEvent = function(from, key, prefix, cmd, params, numeric)
+	local client = laneClients[key]
+	if client then
+		local ok, err = pcall(client.onCommand, client, prefix, cmd, params, numeric)
+		if not ok then
+			io.stderr:write("Dispatch lane ", worker_id, " ", cmd, ": ", err, "\n")
+		end
+	end
+end
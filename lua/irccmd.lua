@@ -26,6 +26,10 @@ require("utils")
 require("timersl")
 require("sockets")
 require("ircprotocol")
+require("workers")
+require("jobs")
+require("dispatch")
+require("async")
 
 
 --[[
@@ -55,6 +59,16 @@ ircclients = ircclients or {} -- currently connected IRC clients
 manager = manager or SelectManager()
 testmode = testmode or nil
 noreconnect = noreconnect or nil
+ping_interval_set = ping_interval_set or nil -- seconds of silence before we PING the server.
+ping_timeout_set = ping_timeout_set or nil -- seconds to wait for the PONG before the link is dead.
+join_set = join_set or nil -- channels to join as soon as we're registered.
+nocap_set = nocap_set or nil -- don't negotiate IRCv3 capabilities.
+format_set = format_set or nil -- "json" or "msgpack" output of every event, see outputEvent.
+ring_set = ring_set or nil -- shared memory ring name for every event, see ringEvent.
+lag_probe_set = lag_probe_set or nil -- seconds between lag measurements.
+workers_set = workers_set or nil -- number of event loop threads, see workers.lua
+lanes_set = lanes_set or nil -- threads for each connection's channel events, see dispatch.lua
+lanescripts = lanescripts or nil
 
 
 clientAdded = event()
@@ -87,6 +101,7 @@ comm_input = comm_input or {
 	RAW = "{1}",
 	DIE = "$RUN client:sendLine('QUIT'); client:disconnect(); manager:stop('all'); noreconnect=true;",
 	ECHO = "$ECHO {1...}",
+	LAG = "$RUN echo(lagReport(client))",
 	["$DEFAULT"] = "PRIVMSG {1} :{2+}",
 }
 
@@ -94,19 +109,28 @@ comm_input = comm_input or {
 -- Values are assumed to be $ECHO but others can be used (e.g. $RUN)
 comm_output = comm_output or {
 	PRIVMSG = "{target} <{nick}> {msg}",
-	-- PRIVMSG = "$RUN echo('{target} <{nick}> {msg} = #' .. string.len('{msg}'))", -- warning, injection!
+	-- PRIVMSG = "$RUN echo('{target} <{nick}> {msg} = #' .. string.len('{msg}'))", -- {msg} is a value, not code.
 	NOTICE = "{target} *{nick}* {msg}",
 	NICK = " *** {nick} is now known as {newnick}",
 	JOIN = " *** {nick} has joined {target}",
 	PART = " *** {nick} has parted {target} ({msg...})",
 	MODE = " *** {nick} sets mode {modes} {params...} for {target}",
 	QUIT = " *** {nick} has quit ({msg...})",
+	NETSPLIT = " *** Netsplit {servers}, {count} quit",
+	NETJOIN = " *** Netjoin {servers}, {count} joined",
 	TOPIC = " *** {nick} changed topic of {target} to '{topic}'",
 	KICK = " *** {nick} has kicked {kicked} from {target} ({msg...})",
 	INVITE = " *** {invited} has been invited to {target}",
 	["353"] = " - {names}", -- NAMES info
 	["366"] = " - ", -- end of NAMES
 	-- ["433"] = " *** {newnick}: {msg}", -- nick already in use
+	-- IRCv3 housekeeping, kept out of the output; "" shows nothing.
+	CAP = "",
+	TAGMSG = "",
+	AWAY = "",
+	ACCOUNT = "",
+	CHGHOST = "",
+	BATCH = "",
 	["?"] = " *** {msg...}", -- any command not specified in this table.
 }
 
@@ -211,14 +235,58 @@ function do_cmdline(argc, argv)
 				comm_output = {}
 			elseif arg == "-noreconnect" then
 				noreconnect = true
+			elseif arg == "-nocap" then
+				nocap_set = true
+			elseif arg == "-ring" then
+				local name, bytes = argvalue:match("^([^,]+),?(%d*)$")
+				assert(name and internal.ring_open, "Invalid -ring")
+				if (worker_id or 0) == 0 then -- One ring per process, shared by the workers.
+					assert(internal.ring_open(name, tonumber(bytes)))
+				end
+				ring_set = name
+			elseif arg == "-format" then
+				assert(argvalue == "json" or argvalue == "msgpack" or argvalue == "text", "Invalid -format")
+				format_set = argvalue ~= "text" and argvalue or nil
+			elseif arg == "-join" then
+				join_set = argvalue
+			elseif arg == "-ping" then
+				ping_interval_set = tonumber(argvalue)
+			elseif arg == "-pingtimeout" then
+				ping_timeout_set = tonumber(argvalue)
+			elseif arg == "-lagprobe" then
+				lag_probe_set = tonumber(argvalue)
+			elseif arg == "-lanes" then
+				lanes_set = assert(tonumber(argvalue), "Invalid -lanes")
+			elseif arg == "-laneload" then
+				if not lanescripts then lanescripts = {} end
+				table.insert(lanescripts, argvalue)
+			elseif arg == "-jobs" then
+				jobs_threads = assert(tonumber(argvalue), "Invalid -jobs")
+			elseif arg == "-workers" then
+				workers_set = assert(tonumber(argvalue), "Invalid -workers")
+			elseif arg == "-cstack" then
+				assert(coroutine.cstacksize, "-cstack needs lua with coco")
+				coroutine.cstacksize(assert(tonumber(argvalue), "Invalid -cstack"))
+			elseif arg == "-cstackpool" then
+				local n = assert(tonumber(argvalue), "Invalid -cstackpool")
+				assert(internal.coco_stacks and internal.coco_stacks(n),
+					"-cstackpool needs lua built with src/lua-5.1/lcoco.c")
+			elseif arg == "-outbuf" then
+				local ms, bytes = argvalue:match("^([%d%.]+),?(%d*)$")
+				assert(ms and internal.console_buffer, "Invalid -outbuf")
+				internal.console_buffer(tonumber(ms), tonumber(bytes))
+			elseif arg == "-inputbatch" then
+				manager.stdinLineBudget = assert(tonumber(argvalue), "Invalid -inputbatch")
 			elseif arg:sub(1, 7) == "-input:" then
 				local ic = arg:sub(7 + 1):upper()
 				if ic == "MSG" then ic = "PRIVMSG" end
 				comm_input[ic] = argvalue
+				getTemplate(argvalue) -- Compile now, errors show at startup.
 			elseif arg:sub(1, 8) == "-output:" then
 				local ic = arg:sub(8 + 1):upper()
 				if ic == "MSG" then ic = "PRIVMSG" end
 				comm_output[ic] = argvalue
+				getTemplate(argvalue)
 			else
 				error("Unknown switch: " .. arg)
 			end
@@ -237,49 +305,213 @@ IrcCmdClient = class(IrcClient)
 
 function IrcCmdClient:init()
 	IrcClient.init(self)
+	self._addrIndex = 1
+	self._reconnects = 0
 end
 
 function IrcCmdClient:connect(...)
+	local ok, errmsg, errcode
 	if select(1, ...) then
 		self._dest = {...}
-		return IrcClient.connect(self, ...)
+		ok, errmsg, errcode = IrcClient.connect(self, ...)
 	elseif self._dest then
-		return IrcClient.connect(self, unpack(self._dest))
+		ok, errmsg, errcode = IrcClient.connect(self, unpack(self._dest))
+	else
+		return nil, "No connect destination"
+	end
+	if ok and self:livenessEnabled() then
+		-- Let the kernel notice a dead peer too, and give up on unacknowledged data.
+		-- TCP keepalive counts whole seconds.
+		local kaok, kaerr = self:keepalive(math.max(1, math.ceil(self.ping_interval_set)),
+			5, 3, math.ceil(self.ping_timeout_set * 1000))
+		if not kaok then
+			io.stderr:write("Unable to set TCP keepalive: ", tostring(kaerr), "\n")
+		end
+	end
+	return ok, errmsg, errcode
+end
+
+-- Connects to one of the addresses; an address of IPv6+host uses IPv6.
+function IrcCmdClient:connectAddress(addr)
+	local addr6 = addr:match("^[iI][pP][vV]6%+(.*)$")
+	if addr6 then
+		io.stderr:write("Connecting to '", addr6, "' (IPv6)...\n")
+		return combinefail(self:connect(addr6, self.port_set, "STREAM", "INET6"))
+	end
+	io.stderr:write("Connecting to '", addr, "'...\n")
+	return combinefail(self:connect(addr, self.port_set, "STREAM", "INET"))
+end
+
+function IrcCmdClient:onReceive(data, arrival)
+	self._lastReceive = internal.milliseconds()
+	return IrcClient.onReceive(self, data, arrival)
+end
+
+function IrcCmdClient:onCommand(prefix, cmd, params, numeric)
+	if cmd == "001" then
+		self._registered = true
+		self._registeredAt = internal.milliseconds()
+		if self.join_set and self.join_set ~= "" then
+			self:sendLinesNow({ "JOIN " .. self.join_set })
+		end
+	elseif (cmd == "433" or cmd == "432" or cmd == "436") and not self._registered then
+		-- Nick in use, erroneous or colliding while registering, nothing else can happen until we get one.
+		-- Through the send line timer, so a server refusing every nick isn't flooded.
+		self:sendLine("NICK " .. self:nextAltNick(cmd == "432"))
+	end
+	return IrcClient.onCommand(self, prefix, cmd, params, numeric)
+end
+
+-- Returns the next nick to try when the current one is refused during registration.
+-- The first try is alt_nick; erroneous is true when the server said the last nick isn't valid.
+function IrcCmdClient:nextAltNick(erroneous)
+	self._altNickTries = (self._altNickTries or 0) + 1
+	if erroneous and self._altNickTries > 1 then
+		self._altNickBase = "irccmd" -- alt_nick isn't valid either.
+	end
+	local base = self._altNickBase or self.alt_nick_set
+	local newnick = replacements2(base)
+	if self._altNickTries > 1 and not base:find("%", 1, true) then
+		-- No random replacements, so the same nick would fail again; add more digits each try.
+		for i = 1, math.min(self._altNickTries - 1, 4) do
+			newnick = newnick .. randomDigit()
+		end
+	end
+	self._nick = newnick
+	return newnick
+end
+
+-- -ping=0 turns off the liveness checks.
+function IrcCmdClient:livenessEnabled()
+	return (self.ping_interval_set or 0) > 0
+end
+
+-- -lagprobe=0 turns off the periodic lag measurements.
+function IrcCmdClient:lagProbeEnabled()
+	return (self.lag_probe_set or 0) > 0
+end
+
+-- Called every second while connected.
+-- PINGs the server after ping_interval seconds of silence,
+-- and drops the link when the PONG doesn't arrive within ping_timeout seconds.
+-- Also PINGs every lag_probe seconds to keep the lag statistics current.
+function IrcCmdClient:checkLiveness()
+	local now = internal.milliseconds()
+	local pending = self:pingPending()
+	if pending then
+		if self:livenessEnabled() and pending >= self.ping_timeout_set * 1000 then
+			io.stderr:write("No reply from server in ", self.ping_timeout_set, " seconds, link is dead\n")
+			self:disconnect("Ping timeout")
+		end
+	elseif self:livenessEnabled() and internal.milliseconds_diff(self._lastReceive, now)
+			>= self.ping_interval_set * 1000 then
+		self:sendPing()
+	elseif self:lagProbeEnabled() and internal.milliseconds_diff(self._pingSent, now)
+			>= self.lag_probe_set * 1000 then
+		self:sendPing()
 	end
-	return nil, "No connect destination"
+end
+
+-- Seconds between reconnects: at least reconnectMinDelay, doubling up to reconnectMaxDelay.
+IrcCmdClient.reconnectMinDelay = 2
+IrcCmdClient.reconnectMaxDelay = 45
+-- The backoff starts over once a connection stays registered this many seconds;
+-- a server which kills us right after 001 still gets the growing delays.
+IrcCmdClient.reconnectStableTime = 60
+
+-- Jittered exponential backoff, moving on to the next address each attempt.
+function IrcCmdClient:scheduleReconnect()
+	local client = self
+	if self._registeredAt and internal.milliseconds_diff(self._registeredAt, internal.milliseconds())
+			>= self.reconnectStableTime * 1000 then
+		self._reconnects = 0
+	end
+	self._registeredAt = nil
+	self._reconnects = self._reconnects + 1
+	local delay = math.min(self.reconnectMaxDelay, self.reconnectMinDelay * 2 ^ (self._reconnects - 1))
+	delay = delay / 2 + delay / 2 * internal.frandom(1000) / 1000
+	delay = math.max(self.reconnectMinDelay, delay)
+	Timer(delay, function(tmr)
+		tmr:stop()
+		if not client:valid() then
+			client._addrIndex = client._addrIndex % #client._addrs + 1
+			if client:connectAddress(client._addrs[client._addrIndex]) then
+				manager:add(client)
+			else
+				client:scheduleReconnect()
+			end
+		end
+	end):start()
 end
 
 function IrcCmdClient:onConnected()
-	local nick, alt_nick = replacements2(self.nick_set), replacements2(self.alt_nick_set)
+	local nick = replacements2(self.nick_set)
+	self._lastReceive = internal.milliseconds()
+	self._pingToken = nil
+	self._pingSent = self._lastReceive
+	self._registered = false
+	self._altNickTries = 0
+	self._altNickBase = nil
+	-- Registration goes out in one write, ahead of anything queued by the send line timer.
+	local lines = {}
+	if not self.nocap_set then
+		table.insert(lines, self:capStart())
+	end
 	if self.password_set then
-		self:sendLine("PASS " .. self.password_set)
+		table.insert(lines, "PASS " .. self.password_set)
+	end
+	self._nick = nick
+	table.insert(lines, "NICK " .. nick)
+	table.insert(lines, "USER " .. nick .. " b c :" .. nick)
+	self:sendLinesNow(lines)
+	if (self:livenessEnabled() or self:lagProbeEnabled()) and not self._livenessTimer then
+		local client = self
+		self._livenessTimer = Timer(1, function()
+			client:checkLiveness()
+		end)
+		self._livenessTimer:start()
 	end
-	-- self:sendLine("NICK " .. nick)
-	self:nick(nick)
-	self:sendLine("USER " .. nick .. " b c :" .. nick)
 	clientAdded(self)
 end
 
 function IrcCmdClient:onDisconnected(msg, code)
+	if self._livenessTimer then
+		self._livenessTimer:stop()
+		self._livenessTimer = nil
+	end
 	manager:remove(self)
 	self:destroy()
 	clientRemoved(self)
 	if not noreconnect then
-		-- Reconnect in N secs.
-		local client = self
-		Timer(45, function(tmr)
-			tmr:stop()
-			if not client:valid() then
-				if client:connect() then -- reuse old args
-					manager:add(self)
-				end
-			end
-		end):start()
+		self:scheduleReconnect()
 	end
 	IrcClient.onDisconnected(self, msg, code)
 end
 
 
+-- Hands the client's channel events to the -lanes threads as well.
+function dispatchClient(client)
+	if not dispatcher then
+		dispatcher = Dispatcher(lanes_set, lanescripts)
+	end
+	dispatcher:addClient(client)
+end
+
+
+-- Returns a line describing the lag to the client's server.
+function lagReport(client)
+	local stats = client:lagStats()
+	if stats.count == 0 then
+		return client:network() .. " lag: no measurements yet"
+	end
+	local queue, reply = client:delayStats()
+	return string.format("%s lag: last %dms, p50 %dms, p99 %dms, max %dms (%d samples)"
+		.. "; queued p50 %dus, p99 %dus; replied p50 %dus, p99 %dus",
+		client:network(), stats.last or 0, stats.p50, stats.p99, stats.max, stats.count,
+		queue.p50, queue.p99, reply.p50, reply.p99)
+end
+
+
 function combinefail(...)
 	if not select(1, ...) then
 		local s = select(2, ...)
@@ -302,6 +534,29 @@ function combinefail(...)
 end
 
 
+-- The NETWORK from ISUPPORT, or the address connected to.
+function clientNetwork(client)
+	local network = client.support and client.support["NETWORK"]
+	if not network and client._addrs then
+		network = client._addrs[client._addrIndex or 1]
+	end
+	return network
+end
+
+-- With -format=json or msgpack every event is written to standard output
+-- as encoded by internal.irc_encode, instead of comm_output text.
+function outputEvent(client, prefix, cmd, params)
+	internal.console_print(internal.irc_encode(client.format_set, prefix, cmd, params,
+		client.lineTags, client.receivedAt or internal.timestamp(), clientNetwork(client)))
+end
+
+-- With -ring=name every event is also written to the shared memory ring, see src/ircring.h.
+function ringEvent(client, prefix, cmd, params)
+	internal.ring_write(prefix, cmd, params, client.lineTags,
+		client.receivedAt or internal.timestamp(), clientNetwork(client))
+end
+
+
 function addIrcClient(settings, noFloodProtection)
 	if type(settings) == "string" then
 		settings = { addresses = settings }
@@ -310,6 +565,11 @@ function addIrcClient(settings, noFloodProtection)
 		-- addrs = "irc.freenode.net"
 		error("Address expected")
 	end
+	-- With -workers each connection belongs to one worker, the others get nil.
+	-- settings.worker can choose the worker, otherwise it's by address.
+	if (settings.worker or workerFor(settings.addresses)) ~= worker_id then
+		return nil
+	end
 	if not settings.nick then
 		settings.nick = nick_set or "Guest%d%d%d%d"
 		if not settings.alt_nick then
@@ -322,19 +582,39 @@ function addIrcClient(settings, noFloodProtection)
 	if not settings.port then
 		settings.port = port_set or 6667
 	end
+	if not settings.join then
+		settings.join = join_set
+	end
+	if settings.nocap == nil then
+		settings.nocap = nocap_set
+	end
+	if settings.format == nil then
+		settings.format = format_set
+	end
+	if not settings.ping_interval then
+		settings.ping_interval = ping_interval_set or 15
+	end
+	if not settings.ping_timeout then
+		settings.ping_timeout = ping_timeout_set or 10
+	end
+	if not settings.lag_probe then
+		settings.lag_probe = lag_probe_set or 60
+	end
 	
 	-- print(" nick = " .. nick .. " - alt_nick = " .. alt_nick .. " ")
 	-- print(" connecting to " .. addrs .. " ")
 
-	local addr
+	-- Multiple addresses are tried in order when the connection fails.
+	local addrs = {}
 	for xa in settings.addresses:gmatch("[^,; ]+") do
-		addr = xa
+		table.insert(addrs, xa)
 	end
 	
 	local client = IrcCmdClient()
 	for k, v in pairs(settings) do
 		client[k .. "_set"] = v
 	end
+	client._addrs = addrs
 	if testmode then
 		io.stderr:write("Test mode, not connecting to IRC\n")
 		client:onReceiveLine(":server 001 Test :Welcome")
@@ -343,14 +623,16 @@ function addIrcClient(settings, noFloodProtection)
 		-- assert(client:connect(addr, port))
 		-- assert(client:connect(addr, port, "STREAM", "UNSPEC"))
 		-- For IPv6 set host to: IPv6+host
-		local addr6 = addr:match("^[iI][pP][vV]6%+(.*)$")
-		if addr6 then
-			io.stderr:write("Connecting to '", addr6, "' (IPv6)...\n")
-			assert(combinefail(client:connect(addr6, settings.port, "STREAM", "INET6")))
-		else
-			io.stderr:write("Connecting to '", addr, "'...\n")
-			assert(combinefail(client:connect(addr, settings.port, "STREAM", "INET")))
+		local ok, err
+		for i = 1, #addrs do
+			client._addrIndex = i
+			ok, err = client:connectAddress(addrs[i])
+			if ok then
+				break
+			end
+			io.stderr:write(err, "\n")
 		end
+		assert(ok, err)
 	end
 	-- internal.console_print("Connected!\n");
 	io.stderr:write("Connected!\n")
@@ -362,7 +644,13 @@ function addIrcClient(settings, noFloodProtection)
 	-- clientAdded(client)
 
 	-- Setup event handlers for output (e.g. PRIVMSG, NOTICE)
-	for serverCmd, serverCmdSyntax in pairs(IrcClient.readServerCommands) do
+	if client.format_set then
+		client.on["*"] = "outputEvent"
+	end
+	if ring_set then
+		client.on["*"] = "ringEvent"
+	end
+	for serverCmd, serverCmdSyntax in pairs(client.format_set and {} or IrcClient.readServerCommands) do
 		if serverCmdSyntax and serverCmdSyntax:len() then
 			local infoSyntax = comm_output[serverCmd]
 			if infoSyntax then
@@ -377,6 +665,10 @@ function addIrcClient(settings, noFloodProtection)
 	if not noFloodProtection then
 		enableSendLineTimer(client, 1.2, 80, 4)
 	end
+
+	if (lanes_set or 0) > 0 then
+		dispatchClient(client)
+	end
 	
 	if not testmode then
 		manager:add(client)
@@ -391,13 +683,24 @@ function irccmd_startup(argc, argv)
 	do_cmdline(argc, argv)
 	
 	local xt, xtmsg = xpcall(function() --------------------
-	
+
+	if (workers_set or 1) > 1 then
+		if worker_id == 0 then
+			startWorkers(workers_set, argv)
+		else
+			worker_count = workers_set
+		end
+		workerListen()
+	end
+
+	-- The command line connection and standard input belong to the main thread.
 	local client = addIrcClient{
 		nick = nick_set,
 		alt_nick = alt_nick_set,
 		addresses = addresses_set,
 		port = port_set,
 		password = password_set,
+		worker = 0,
 	}
 
 	if loadscripts then
@@ -417,13 +720,15 @@ function irccmd_startup(argc, argv)
 		end
 	end):start()
 
-	manager.onStandardInput = function(_, input)
-		local ln = input:gsub("[\r\n]+", "")
-		if ln:sub(1, 1) == "/" then
-			local cmd, strparams = ln:match("/([^ ]+)[ ]?(.*)")
-			client:doUserCommand(comm_input, cmd, strparams)
-		elseif ln ~= "" then
-			client:doUserCommand(comm_input, "$DEFAULT", ln)
+	if client then
+		manager.onStandardInput = function(_, input)
+			local ln = input:gsub("[\r\n]+", "")
+			if ln:sub(1, 1) == "/" then
+				local cmd, strparams = ln:match("/([^ ]+)[ ]?(.*)")
+				client:doUserCommand(comm_input, cmd, strparams)
+			elseif ln ~= "" then
+				client:doUserCommand(comm_input, "$DEFAULT", ln)
+			end
 		end
 	end
 
@@ -452,11 +757,17 @@ function irccmd_startup(argc, argv)
 
 	exiting()
 
-	disableSendLineTimer(client)
+	stopDispatchers()
+	stopWorkers()
+	stopJobs()
 
-	manager:remove(client)
+	if client then
+		disableSendLineTimer(client)
 
-	client:destroy()
+		manager:remove(client)
+
+		client:destroy()
+	end
 
 	-- internal.console_print("Done!\n");
 
@@ -475,6 +786,7 @@ end
 
 -- Do this last so that everything else is setup.
 pcall(require, "ircnicklist") -- Not a hard dependency.
+pcall(require, "ircmodes")
 
 
 if internal._icDebug then
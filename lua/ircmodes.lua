@@ -0,0 +1,164 @@
+-- Copyright 2012-2014 Christopher E. Miller
+-- License: GPLv2, see LICENSE file.
+
+-- Simply require this file and IrcClients keep the modes of the channels they're on.
+-- MODE changes are applied as they arrive by internal.irc_mode_apply,
+-- using CHANMODES and PREFIX from ISUPPORT.
+-- Member prefix modes are kept in the nicklist entries, see ircnicklist.lua.
+-- getChannelMode(client, channel, mode) - returns true or the parameter if set, or nil.
+-- isChannelOp(client, channel, nick) - true if the nick has +o (or a higher prefix mode).
+
+
+require("ircnicklist")
+
+
+local function chanModesState(client, channel, create)
+	local chans = client._chanModes
+	if not chans then
+		return nil
+	end
+	local key = client.tolower(channel)
+	local state = chans[key]
+	if not state and create then
+		state = { modes = {}, lists = {} }
+		chans[key] = state
+	end
+	return state
+end
+
+function cm_apply(client, channel, params, first)
+	local state = chanModesState(client, channel, true)
+	local members = client._nicklists and client._nicklists[channel]
+	internal.irc_mode_apply(state, members, params, first,
+		client.support and client.support["CHANMODES"],
+		client.prefixModes, client.tolower)
+end
+
+function cm_on_mode(client, prefix, cmd, params)
+	local channel = params[1] and params[2] and client:channelNameFromTarget(params[1])
+	if channel then
+		cm_apply(client, channel, params, 2)
+	end
+end
+
+function cm_on_324(client, prefix, cmd, params) -- channel modes
+	local channel = params[2] and params[3] and client:channelNameFromTarget(params[2])
+	if channel then
+		chanModesState(client, channel, true).modes = {}
+		cm_apply(client, channel, params, 3)
+	end
+end
+
+-- Ban, exception and invite lists: 367 b, 348 e, 346 I.
+local listReplies = { ["367"] = "b", ["348"] = "e", ["346"] = "I" }
+
+function cm_on_list(client, prefix, cmd, params)
+	local channel = params[2] and params[3] and client:channelNameFromTarget(params[2])
+	if channel then
+		local lists = chanModesState(client, channel, true).lists
+		local m = listReplies[cmd]
+		lists[m] = lists[m] or {}
+		lists[m][params[3]] = true
+	end
+end
+
+function cm_on_join(client, prefix, cmd, params)
+	if client.strcmp(nickFromSource(prefix or ""), client:nick()) == 0 then
+		local channel = client:channelNameFromTarget(params[1])
+		if channel then
+			client._chanModes[client.tolower(channel)] = { modes = {}, lists = {} }
+		end
+	end
+end
+
+function cm_on_part(client, prefix, cmd, params)
+	if client.strcmp(nickFromSource(prefix or ""), client:nick()) == 0 then
+		local channel = client:channelNameFromTarget(params[1])
+		if channel then
+			client._chanModes[client.tolower(channel)] = nil
+		end
+	end
+end
+
+function cm_on_kick(client, prefix, cmd, params)
+	if params[2] and client.strcmp(params[2], client:nick()) == 0 then
+		cm_on_part(client, client:nick(), cmd, params)
+	end
+end
+
+function cm_on_quit(client, prefix, cmd, params)
+	if client.strcmp(nickFromSource(prefix or ""), client:nick()) == 0 then
+		client._chanModes = {}
+	end
+end
+
+function regChanModes(client)
+	if client._chanModes then
+		return -- Already setup for this client.
+	end
+	client._chanModes = {}
+	client.on["MODE"] = "cm_on_mode"
+	client.on["324"] = "cm_on_324"
+	client.on["367"] = "cm_on_list"
+	client.on["348"] = "cm_on_list"
+	client.on["346"] = "cm_on_list"
+	client.on["JOIN"] = "cm_on_join"
+	client.on["PART"] = "cm_on_part"
+	client.on["KICK"] = "cm_on_kick"
+	client.on["QUIT"] = "cm_on_quit"
+end
+
+
+-- Returns the channel's modes table: mode = true or its parameter; nil if not on the channel.
+function getChannelModes(client, channel)
+	local state = chanModesState(client, channel)
+	return state and state.modes
+end
+
+function getChannelMode(client, channel, mode)
+	local state = chanModesState(client, channel)
+	return state and state.modes[mode]
+end
+
+-- Returns the channel's list for a list mode such as "b": mask = true; nil if unknown.
+function getChannelList(client, channel, mode)
+	local state = chanModesState(client, channel)
+	return state and state.lists[mode]
+end
+
+-- Returns the nick's prefix modes on the channel, such as "ov", or nil if not on it.
+function getNickModes(client, channel, nick)
+	local nl = client._nicklists and client._nicklists[channel]
+	local entry = nl and nl[nick]
+	if entry then
+		return entry.modes or ""
+	end
+end
+
+function nickHasMode(client, channel, nick, mode)
+	local modes = getNickModes(client, channel, nick)
+	return modes ~= nil and modes:find(mode, 1, true) ~= nil
+end
+
+-- True if the nick has +o or a prefix mode ranked above it, such as +a or +q.
+function isChannelOp(client, channel, nick)
+	local modes = getNickModes(client, channel, nick)
+	if not modes or modes == "" then
+		return false
+	end
+	local opRank = (client.prefixModes or "ov"):find("o", 1, true)
+	return opRank ~= nil and client.prefixModes:find(modes:sub(1, 1), 1, true) <= opRank
+end
+
+function isChannelVoice(client, channel, nick)
+	return nickHasMode(client, channel, nick, "v")
+end
+
+
+if irccmd then
+	clientAdded:add("regChanModes")
+
+	for i, client in ipairs(ircclients) do
+		regChanModes(client)
+	end
+end
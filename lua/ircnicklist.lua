@@ -6,6 +6,14 @@
 -- Utility functions are provided, as well as:
 -- client:nicklist(chan) - returns table: key=nick, value=table:
 -- 	joined - optional, set to the time when they joined, or nil if they were here already.
+-- 	modes - their channel prefix modes in PREFIX order, such as "ov", from NAMES.
+-- getUserInfo(client, nick) - returns the table for the user, if known:
+-- 	nick, user, host, account (false if not logged in), realname, away (message, with away-notify)
+-- User info is learned from JOIN and other prefixes, and from a WHO of each channel we join,
+-- sent one channel at a time, nicklist_who_interval seconds apart.
+
+nicklist_who = nicklist_who ~= false -- set to false to not WHO channels we join.
+nicklist_who_interval = nicklist_who_interval or 2
 
 local function case_insensitive_mt_for_client(client)
 	return {
@@ -69,13 +77,49 @@ function nl_make(client, channel)
 	return setmetatable({}, case_insensitive_mt_for_client(client))
 end
 
+-- Updates the user's info from a nick!user@host prefix, and account/realname if known.
+function nl_learn(client, source, account, realname)
+	local nick, user, host = sourceParts(source)
+	local u = client._users[nick]
+	if not u then
+		u = { nick = nick }
+		client._users[nick] = u
+	end
+	u.nick = nick
+	u.user = user or u.user
+	u.host = host or u.host
+	if account ~= nil then
+		u.account = account
+	end
+	u.realname = realname or u.realname
+	return u
+end
+
+-- Forgets the user if not on any of our channels.
+function nl_forget(client, nick)
+	for channel, nl in pairs(client._nicklists) do
+		if nl[nick] then
+			return
+		end
+	end
+	client._users[nick] = nil
+end
+
 function nl_on_nick(client, prefix, cmd, params)
 	local nick = nickFromSource(prefix)
 	local newnick = params[1]
+	local u = client._users[nick]
+	if u then
+		client._users[nick] = nil
+		u.nick = newnick
+		client._users[newnick] = u
+	end
 	for channel, nl in pairs(client._nicklists) do
 		local value = nl[nick]
-		value.nick = newnick
-		nl[newnick], nl[nick] = nl[nick], nil
+		if value then
+			value.nick = newnick
+			nl[newnick], nl[nick] = nl[nick], nil
+		end
 	end
 
 	-- Fire artificial NICK_CHAN events per channel this guy is on,
@@ -94,9 +138,13 @@ function nl_on_part(client, prefix, cmd, params)
 	if nl then
 		if nick == client:nick() then
 			client._nicklists[channel] = nil
+			for k, v in pairs(nl) do
+				nl_forget(client, v.nick)
+			end
 			-- original_channel_names[client.tolower(channel)] = nil -- which network?
 		else
 			client._nicklists[channel][nick] = nil
+			nl_forget(client, nick)
 		end
 	end
 end
@@ -110,6 +158,15 @@ function nl_on_join(client, prefix, cmd, params)
 		client._nicklists[channel] = nl_make(client, channel)
 	end
 	client._nicklists[channel][nick] = { nick = nick, joined = os.time() }
+	-- With extended-join, params are: channel, account ("*" if none), realname.
+	if params[3] then
+		nl_learn(client, prefix, params[2] ~= "*" and params[2], params[3])
+	else
+		nl_learn(client, prefix)
+	end
+	if client.strcmp(nick, client:nick()) == 0 then
+		nl_queueWho(client, channel)
+	end
 end
 
 function nl_on_quit(client, prefix, cmd, params)
@@ -117,6 +174,7 @@ function nl_on_quit(client, prefix, cmd, params)
 	if nick == client:nick() then
 		-- It's me quitting, clear everything.
 		client._nicklists = nil
+		client._users = nil
 	else
 		local nick = nickFromSource(prefix)
 		-- Fire artificial QUIT_CHAN events per channel this guy is on,
@@ -127,6 +185,36 @@ function nl_on_quit(client, prefix, cmd, params)
 				nl[nick] = nil
 			end
 		end
+		client._users[nick] = nil
+	end
+end
+
+-- The nicks of a netsplit, all at once; see IrcClient:_netStorm.
+function nl_on_netsplit(client, prefix, cmd, params)
+	local keys = {}
+	for i, source in ipairs(params.sources) do
+		keys[i] = client.tolower(nickFromSource(source))
+	end
+	for channel, nl in pairs(client._nicklists) do
+		for i = 1, #keys do
+			rawset(nl, keys[i], nil)
+		end
+	end
+	for i = 1, #keys do
+		rawset(client._users, keys[i], nil)
+	end
+end
+
+function nl_on_netjoin(client, prefix, cmd, params)
+	local now = os.time()
+	for i, source in ipairs(params.sources) do
+		local channel = client:channelNameFromTarget(params.channels[i])
+		local nl = channel and client._nicklists[channel]
+		if nl then
+			local nick = nickFromSource(source)
+			nl[nick] = { nick = nick, joined = now }
+			nl_learn(client, source)
+		end
 	end
 end
 
@@ -136,9 +224,28 @@ function nl_on_kick(client, prefix, cmd, params)
 	if nl then
 		local kicked = params[2]
 		nl[kicked] = nil
+		nl_forget(client, kicked)
+	end
+end
+
+-- account-notify and chghost keep the user info current.
+function nl_on_account(client, prefix, cmd, params)
+	nl_learn(client, prefix, params[1] ~= "*" and params[1])
+end
+
+-- away-notify: away is the away message, or nil when back.
+function nl_on_away(client, prefix, cmd, params)
+	local u = client._users[nickFromSource(prefix)]
+	if u then
+		u.away = params[1]
 	end
 end
 
+function nl_on_chghost(client, prefix, cmd, params)
+	local nick = nickFromSource(prefix)
+	nl_learn(client, nick .. "!" .. params[1] .. "@" .. params[2])
+end
+
 function nl_on_353(client, prefix, cmd, params) -- NAMES info
 	local channel = client:channelNameFromTarget(params[3])
 	if not client._nicklists[channel] then
@@ -146,10 +253,72 @@ function nl_on_353(client, prefix, cmd, params) -- NAMES info
 		client._nicklists[channel] = nl_make(client, channel)
 	end
 	local nl = client._nicklists[channel]
-	for xnick in params[4]:gmatch("[^ ]+") do
-		local prefixes, nick = client:getNickInfo(xnick)
-		if not nl[nick] then
-			nl[nick] = { nick = nick }
+	local count, sources = internal.irc_names(nl, params[4],
+		client.prefixSymbols, client.prefixModes, client.tolower)
+	if sources then
+		-- userhost-in-names
+		for i = 1, #sources do
+			nl_learn(client, sources[i])
+		end
+	end
+end
+
+
+-- WHOX token for our replies, to tell them from other WHOX queries.
+local WHO_TOKEN = "112"
+
+-- WHO the channel after the ones already waiting.
+function nl_queueWho(client, channel)
+	if not nicklist_who or not client.query then
+		return
+	end
+	if client.caps and client.caps["userhost-in-names"] and not (client.support and client.support["WHOX"]) then
+		return -- NAMES already gave the hosts, and plain WHO has no accounts.
+	end
+	table.insert(client._whoQueue, channel)
+	if not client._whoBusy then
+		nl_whoNext(client)
+	end
+end
+
+function nl_whoNext(client)
+	local channel = table.remove(client._whoQueue, 1)
+	if not channel then
+		client._whoBusy = false
+		return
+	end
+	client._whoBusy = true
+	local whox = client.support and client.support["WHOX"]
+	local line = "WHO " .. channel
+	if whox then
+		line = line .. " %tnuhar," .. WHO_TOKEN
+	end
+	client:query(line, function(replies, err)
+		if client._users then
+			nl_ingestWho(client, replies)
+		end
+		local t = Timer(nicklist_who_interval, function(t)
+			t:stop()
+			nl_whoNext(client)
+		end)
+		t:start()
+	end, 60)
+end
+
+-- Fills user info from WHO (352) or WHOX (354) replies.
+function nl_ingestWho(client, replies)
+	for i = 1, #replies do
+		local r = replies[i]
+		local params = r.params
+		if r.cmd == "354" and params[2] == WHO_TOKEN then
+			-- me token user host nick account realname
+			local account = params[6]
+			nl_learn(client, params[5] .. "!" .. params[3] .. "@" .. params[4],
+				account ~= "0" and account, params[7])
+		elseif r.cmd == "352" then
+			-- me channel user host server nick flags :hops realname
+			local realname = params[8] and params[8]:match("^%d+ (.*)$")
+			nl_learn(client, params[6] .. "!" .. params[3] .. "@" .. params[4], nil, realname)
 		end
 	end
 end
@@ -171,6 +340,8 @@ function regNickList(client)
 		-- This can happen when reloading this file.
 	end
 	client._nicklists = setmetatable({}, case_insensitive_mt_for_client(client))
+	client._users = setmetatable({}, case_insensitive_mt_for_client(client))
+	client._whoQueue = {}
 	client.nicklist = function(client, channel)
 		local nl = client._nicklists[channel]
 		if nl then
@@ -182,8 +353,13 @@ function regNickList(client)
 	client.on["PART"] = "nl_on_part"
 	client.on["JOIN"] = "nl_on_join"
 	client.on["QUIT"] = "nl_on_quit"
+	client.on["NETSPLIT"] = "nl_on_netsplit"
+	client.on["NETJOIN"] = "nl_on_netjoin"
 	client.on["KICK"] = "nl_on_kick"
 	client.on["353"] = "nl_on_353"
+	client.on["ACCOUNT"] = "nl_on_account"
+	client.on["CHGHOST"] = "nl_on_chghost"
+	client.on["AWAY"] = "nl_on_away"
 end
 
 -- Returns a table: {[channel] = {[nick] = {joined = ts}}}
@@ -195,6 +371,19 @@ function getNicklists(client)
 	return tmp
 end
 
+-- Returns the user's info table (see top), or nil if not on any of our channels.
+function getUserInfo(client, nick)
+	return client._users and client._users[nick]
+end
+
+-- Returns nick!user@host, or nil if the host isn't known yet.
+function getUserHostmask(client, nick)
+	local u = getUserInfo(client, nick)
+	if u and u.user and u.host then
+		return u.nick .. "!" .. u.user .. "@" .. u.host
+	end
+end
+
 function getNickOnChannel(client, nick, channel)
 	local nl = client:nicklist(channel)
 	if nl and nl[nick] then
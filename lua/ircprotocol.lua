@@ -3,6 +3,7 @@
 
 require("irccmd_internal")
 require("utils")
+require("timers")
 
 
 function nickFromSource(source)
@@ -66,6 +67,13 @@ function IrcClient:init(socket)
 	-- print("Initializing IrcClient")
 
 	self.strcmp = internal.compare_rfc1459
+	self.lagHistogram = internal.histogram() -- round trip times of sendPing, in milliseconds.
+	self.queueHistogram = internal.histogram() -- line arrival to dispatch, in microseconds.
+	self.replyHistogram = internal.histogram() -- line arrival to reply write, in microseconds.
+	self._queries = {} -- pending queries sent with query(), oldest first.
+	self.caps = {} -- IRCv3 capabilities enabled, see capStart.
+	self._onTargets = {} -- cmd = array of { target, func }, see onTarget.
+	self._onVersion = 0 -- Bumped when on[...] gets a new event or onTarget changes, see _handlersFor.
 
 	-- self.support = {}
 	-- self.prefixSymbols = ""
@@ -86,6 +94,7 @@ function IrcClient:init(socket)
 		if not e then
 			e = event()
 			rawset(t, key, e)
+			self._onVersion = self._onVersion + 1
 		end
 		if first then
 			e:insert(1, value)
@@ -103,10 +112,11 @@ function IrcClient:init(socket)
 	setmetatable(self.on, onmt)
 
 	self.on["PING"] = function(client, prefix, cmd, params)
+		-- Reply right away, a queued PONG can get us dropped for ping timeout.
 		if #params >= 1 then
-			self:sendLine("PONG :" .. params[1])
+			self:sendLineNow("PONG :" .. params[1])
 		else
-			self:sendLine("PONG")
+			self:sendLineNow("PONG")
 		end
 		-- internal.console_print("Ping? Pong!\n")
 	end
@@ -158,6 +168,8 @@ IrcClient.readServerCommands = {
 	["353"] = "{target} {symbol} {chan} {names}", -- NAMES info
 	["366"] = "{target} {symbol} {msg}", -- end of NAMES
 	["433"] = "{target} {newnick} {msg}", -- nick already in use
+	NETSPLIT = "{servers} {count} {nicks}", -- see IrcClient:_netStorm
+	NETJOIN = "{servers} {count} {nicks}",
 	["?"] = "{target} {msg...}", -- any command not specified in this table.
 }
 
@@ -187,19 +199,17 @@ function IrcClient:doDefaultServerAction(client, prefix, serverCmd, params)
 		if not infoSyntax then
 			infoSyntax = comm_output["?"]
 		end
-		if infoSyntax and infoSyntax:len() then
+		if infoSyntax and infoSyntax:len() > 0 then -- "" shows nothing.
 			local values = {}
 			values["source"] = prefix
 			values["cmd"] = serverCmd
-			getServerCommandValues(serverCmdSyntax, params, values)
-			if infoSyntax:sub(1, 1) == '$' then
-				local magicCmd, magicInfoSyntax = infoSyntax:match("([^ ]+)[ ]?(.*)")
-				local info = self:translate2(magicInfoSyntax, values)
-				doMagic(self, magicCmd, info)
+			getTemplate(serverCmdSyntax).template:values(params, values)
+			local info = getTemplate(infoSyntax)
+			if info.magicCmd then
+				doMagicTemplate(self, info, values)
 			else
-				local info = self:translate2(infoSyntax, values)
 				-- doMagic(self, "$ECHO", info)
-				internal.console_print(info, "\n")
+				internal.console_print(info.template:render(values, self), "\n")
 			end
 		end
 	end
@@ -210,10 +220,78 @@ function IrcClient:sendLine(line)
 	if doraw then
 		doraw:write("SEND: `", line, "`\n")
 	end
+	if self.receivedAt then
+		self:_recordReply()
+	end
 	-- assert(not line:find("\n", 1, true), "Did not expect newline characters in IrcClient:sendLine(line)")
 	return self:send(line .. "\r\n")
 end
 
+-- Same as sendLine but never delayed by a send line timer (see enableSendLineTimer).
+function IrcClient:sendLineNow(line)
+	return IrcClient.sendLine(self, line)
+end
+
+-- Sends all the lines in a single write, never delayed by a send line timer.
+-- IRC newline characters will be appended to each line.
+function IrcClient:sendLinesNow(lines)
+	if doraw then
+		for i = 1, #lines do
+			doraw:write("SEND: `", lines[i], "`\n")
+		end
+	end
+	if self.receivedAt then
+		self:_recordReply()
+	end
+	return self:send(table.concat(lines, "\r\n") .. "\r\n")
+end
+
+-- Sends a PING with a token, the matching PONG sets self.lag and calls onLag.
+-- Only one PING is outstanding at a time; returns false if one is pending.
+function IrcClient:sendPing()
+	if self._pingToken then
+		return false
+	end
+	self._pingSent = internal.milliseconds()
+	self._pingToken = "LAG" .. self._pingSent
+	self:sendLineNow("PING :" .. self._pingToken)
+	return true
+end
+
+-- Returns milliseconds since the outstanding PING was sent, or nil if none.
+function IrcClient:pingPending()
+	if self._pingToken then
+		return internal.milliseconds_diff(self._pingSent, internal.milliseconds())
+	end
+	return nil
+end
+
+-- Called when the PONG for sendPing arrives; ms is the round trip time.
+function IrcClient:onLag(ms)
+	self.lagHistogram:record(ms)
+end
+
+-- Records how long the line being handled waited for this reply.
+-- The sendLine timer calls this when queueing, so flood delays aren't counted.
+function IrcClient:_recordReply()
+	local delay = internal.timestamp() - self.receivedAt
+	self.replyHistogram:record(math.max(0, delay * 1000000))
+end
+
+-- Returns tables with statistics (see lagStats) in microseconds:
+-- how long lines waited to be dispatched, and how long until handlers replied.
+function IrcClient:delayStats()
+	return self.queueHistogram:stats(), self.replyHistogram:stats()
+end
+
+-- Returns a table with the lag statistics in milliseconds:
+-- last, count, min, max, mean, p50, p90, p99
+function IrcClient:lagStats()
+	local stats = self.lagHistogram:stats()
+	stats.last = self.lag
+	return stats
+end
+
 -- Returns the channel user mode for the prefix, or nil if not a prefix on this server.
 function IrcClient:prefixToMode(prefix)
 	assert(prefix:len() == 1)
@@ -269,7 +347,8 @@ end
 
 -- cmd will always be uppercase.
 -- params is a table with the parameters.
-function IrcClient:onCommand(prefix, cmd, params)
+-- numeric is the integer code of a numeric cmd if known, see internal.irc_parse.
+function IrcClient:onCommand(prefix, cmd, params, numeric)
 	-- internal.console_print("got command ", cmd, " with params #", #params, "\n")
 	-- print("IRC:", prefix or "<nil>", cmd or "<nil>", unpack(params)) -----
 
@@ -282,6 +361,8 @@ function IrcClient:onCommand(prefix, cmd, params)
 	end
 
 	if cmd == "001" then
+		self._capNegotiating = nil -- Registered, the server didn't wait for CAP.
+		self.serverName = prefix -- The server we're connected to.
 		self.strcmp = internal.compare_rfc1459
 		self.tolower = internal.tolower_rfc1459
 		self.support = {}
@@ -343,31 +424,155 @@ function IrcClient:onCommand(prefix, cmd, params)
 		end
 	end
 
-	if self.on["*"] then
-		if "stop" == self.on["*"](self, prefix, cmd, params) then return "stop" end
+	if cmd == "PONG" and self._pingToken and params[#params] == self._pingToken then
+		-- Reply to our own sendPing, not shown to handlers.
+		self.lag = internal.milliseconds_diff(self._pingSent, internal.milliseconds())
+		self._pingToken = nil
+		self:onLag(self.lag)
+		return
+	end
+
+	if cmd == "CAP" then
+		self:_onCap(params)
+	end
+
+	if (self._storm or cmd == "QUIT" or cmd == "JOIN" or cmd == "BATCH")
+			and self:_netStorm(prefix, cmd, params) then
+		return
+	end
+
+	if (self._batches or cmd == "BATCH") and self:_batchLine(prefix, cmd, params, numeric) then
+		return
+	end
+
+	if self._queries[1] and self:_queryReply(prefix, cmd, params) then
+		return
+	end
+
+	if self.dispatch then
+		-- Copy the event to the lanes too, see dispatch.lua
+		self.dispatch:route(self, prefix, cmd, params, numeric)
+	end
+
+	local handlers = self:_handlersFor(cmd, numeric)
+	if handlers.any then
+		if "stop" == handlers.any(self, prefix, cmd, params) then return "stop" end
+	end
+	local targets = handlers.targets
+	if targets and params[1] then
+		local tolower = self.tolower or string.lower
+		local e = targets[tolower(params[1])]
+		if not e and self.prefixSymbols and self.prefixSymbols:find(params[1]:sub(1, 1), 1, true) then
+			-- STATUSMSG, such as to @#chan, goes to the channel's subscribers.
+			local channel = self.support and self:channelNameFromTarget(params[1])
+			e = channel and targets[tolower(channel)]
+		end
+		if e then
+			if "stop" == e(self, prefix, cmd, params) then return "stop" end
+		end
+	end
+	if handlers.cmd then
+		if "stop" == handlers.cmd(self, prefix, cmd, params) then return "stop" end
+	end
+end
+
+-- Returns { any = on["*"], targets = onTarget events by lowercase target,
+-- cmd = on[cmd] or on["?"] } for the command, compiled once and kept until
+-- on[...] gets a new event, onTarget changes (_onVersion) or the casemapping changes.
+-- The events compile their own handler lists, see event:compiled in utils.lua.
+-- Numerics are kept by their integer code when given.
+function IrcClient:_handlersFor(cmd, numeric)
+	local compiled = self._compiledOn
+	if self._compiledVersion ~= self._onVersion or self._compiledTolower ~= self.tolower then
+		compiled = {}
+		self._compiledOn = compiled
+		self._compiledVersion = self._onVersion
+		self._compiledTolower = self.tolower
+	end
+	local handlers = compiled[numeric or cmd]
+	if not handlers then
+		local on = self.on
+		handlers = { any = on["*"], cmd = on[cmd] }
+		local subs = self._onTargets[cmd]
+		if subs and #subs > 0 then
+			local tolower = self.tolower or string.lower
+			handlers.targets = {}
+			for i = 1, #subs do
+				local key = tolower(subs[i].target)
+				local e = handlers.targets[key]
+				if not e then
+					e = event()
+					handlers.targets[key] = e
+				end
+				e[#e + 1] = subs[i].func -- Not add(), which skips a func already there.
+			end
+		end
+		handlers.cmd = handlers.cmd or on["?"] -- Target subscriptions only add handlers.
+		compiled[numeric or cmd] = handlers
+	end
+	return handlers
+end
+
+-- Calls func(client, prefix, cmd, params) for cmd only when params[1] is target,
+-- such as onTarget("PRIVMSG", "#ops", func); compared using the server's casemapping.
+-- Handlers of client.on[cmd], or on["?"] without any, still get every cmd.
+function IrcClient:onTarget(cmd, target, func)
+	assert(cmd and target and func)
+	cmd = cmd:upper()
+	local subs = self._onTargets[cmd]
+	if not subs then
+		subs = {}
+		self._onTargets[cmd] = subs
 	end
-	if self.on[cmd] then
-		if "stop" == self.on[cmd](self,prefix, cmd, params) then return "stop" end
-	elseif self.on["?"] then
-		if "stop" == self.on["?"](self,prefix, cmd, params) then return "stop" end
+	table.insert(subs, { target = target, func = func })
+	self._onVersion = self._onVersion + 1
+end
+
+-- Removes a handler added by onTarget; returns true if found.
+function IrcClient:removeTarget(cmd, target, func)
+	local subs = self._onTargets[cmd:upper()]
+	local tolower = self.tolower or string.lower
+	for i = 1, subs and #subs or 0 do
+		if subs[i].func == func and tolower(subs[i].target) == tolower(target) then
+			table.remove(subs, i)
+			self._onVersion = self._onVersion + 1
+			return true
+		end
 	end
+	return false
 end
 
-function IrcClient:onReceiveLine(line)
+-- While a line is being handled, receivedAt is when it reached the machine
+-- and dispatchedAt is when its handlers started (see internal.timestamp).
+-- lineTags is the line's raw IRCv3 tags, such as "batch=1;time=...", or nil; see tag().
+function IrcClient:onReceiveLine(line, arrival)
 	line = internal.irc_input(line) -- fix the IRC line
 	-- internal.console_print("IRC: ", line, "\n"); -----
 	if doraw then
 		doraw:write("READ: ", line, "\n")
 	end
-	local prefix, cmd, params = internal.irc_parse(line)
+	local prefix, cmd, params, tags, numeric = internal.irc_parse(line) -- cmd is uppercase.
+	self.lineTags = tags
 	if cmd then
-		cmd = cmd:upper()
-		return self:onCommand(prefix, cmd, params)
+		local now = internal.timestamp()
+		arrival = arrival or now
+		self.receivedAt, self.dispatchedAt = arrival, now
+		self.queueHistogram:record(math.max(0, (now - arrival) * 1000000))
+		local result = self:onCommand(prefix, cmd, params, numeric)
+		self.receivedAt, self.dispatchedAt = nil, nil
+		self.lineTags = nil
+		return result
 	else
 		io.stderr:write("WARNING: invalid command received: ", line, "\n")
 	end
 end
 
+-- Returns the value of the IRCv3 tag on the line being handled, or nil if not there.
+-- Values are unescaped when asked for.
+function IrcClient:tag(key)
+	return self.lineTags and internal.irc_tag(self.lineTags, key)
+end
+
 function IrcClient:sendMsg(to, msg, priority)
 	self:sendLine("PRIVMSG " .. to .. " :" .. msg, priority)
 end
@@ -392,6 +597,467 @@ function IrcClient:sendCommand(cmd, ...)
 end
 
 
+-- Capabilities requested when the server offers them.
+IrcClient.wantCaps = {
+	"multi-prefix", "userhost-in-names", "away-notify", "account-notify",
+	"extended-join", "chghost", "batch", "message-tags", "server-time", "cap-notify",
+}
+
+-- Returns the line to send first when registering, to hold registration for CAP.
+-- The capabilities in wantCaps that the server has are requested,
+-- then CAP END is sent; self.caps[cap] is true for those enabled.
+function IrcClient:capStart()
+	self.caps = {}
+	self._capNegotiating = true
+	self._capOffered = {}
+	self._capPending = 0
+	return "CAP LS 302"
+end
+
+-- Requests the wanted capabilities among caps, a space separated list from LS or NEW.
+function IrcClient:_capRequest(caps)
+	local offered = {}
+	for cap in caps:gmatch("%S+") do
+		offered[cap:match("^[^=]*")] = true
+	end
+	local req = {}
+	for i, cap in ipairs(self.wantCaps) do
+		if offered[cap] and not self.caps[cap] then
+			table.insert(req, cap)
+		end
+	end
+	if #req > 0 then
+		self._capPending = (self._capPending or 0) + 1
+		self:sendLineNow("CAP REQ :" .. table.concat(req, " "))
+		return true
+	end
+	return false
+end
+
+function IrcClient:_capEnd()
+	if self._capNegotiating and (self._capPending or 0) == 0 then
+		self._capNegotiating = nil
+		self:sendLineNow("CAP END")
+	end
+end
+
+-- params: target, subcommand, [*,] caps
+function IrcClient:_onCap(params)
+	local sub = (params[2] or ""):upper()
+	local caps = params[#params] or ""
+	if sub == "LS" then
+		if not self._capNegotiating then
+			return
+		end
+		table.insert(self._capOffered, caps)
+		if params[3] ~= "*" then -- Last line of the list.
+			self:_capRequest(table.concat(self._capOffered, " "))
+			self._capOffered = {}
+			self:_capEnd()
+		end
+	elseif sub == "ACK" or sub == "NAK" then
+		if sub == "ACK" then
+			for cap in caps:gmatch("%S+") do
+				if cap:sub(1, 1) == "-" then
+					self.caps[cap:sub(2)] = nil
+				else
+					self.caps[cap] = true
+				end
+			end
+		end
+		self._capPending = math.max(0, (self._capPending or 1) - 1)
+		self:_capEnd()
+	elseif sub == "NEW" then
+		self:_capRequest(caps)
+	elseif sub == "DEL" then
+		for cap in caps:gmatch("%S+") do
+			self.caps[cap] = nil
+		end
+	end
+end
+
+
+-- Lines in an IRCv3 batch are held until the batch ends, then handlers of
+-- on["BATCH"] get them as one event: params are the batch type and its parameters,
+-- params.lines is an array of { prefix = prefix, cmd = cmd, params = params, tags = tags, numeric = numeric }.
+-- Without a BATCH handler, the lines are handled one by one when the batch ends.
+-- Netsplit and netjoin batches become NETSPLIT and NETJOIN events, see _netStorm.
+function IrcClient:_batchLine(prefix, cmd, params, numeric)
+	if cmd == "BATCH" and params[1] then
+		local id = params[1]:sub(2)
+		if params[1]:sub(1, 1) == "+" then
+			self._batches = self._batches or {}
+			local bparams = {}
+			for i = 2, #params do
+				bparams[i - 1] = params[i]
+			end
+			bparams.lines = {}
+			self._batches[id] = { prefix = prefix, params = bparams }
+			return true
+		elseif params[1]:sub(1, 1) == "-" and self._batches and self._batches[id] then
+			local batch = self._batches[id]
+			self._batches[id] = nil
+			if not next(self._batches) then
+				self._batches = nil
+			end
+			self:_batchDone(batch)
+			return true
+		end
+		return false
+	end
+	local id = self:tag("batch")
+	local batch = id and self._batches[id]
+	if batch then
+		table.insert(batch.params.lines, { prefix = prefix, cmd = cmd, params = params, tags = self.lineTags,
+			numeric = numeric })
+		return true
+	end
+	return false
+end
+
+function IrcClient:_batchDone(batch)
+	if self.on["BATCH"] then
+		self.on["BATCH"](self, batch.prefix, "BATCH", batch.params)
+	else
+		local tags = self.lineTags
+		local lines = batch.params.lines
+		for i = 1, #lines do
+			self.lineTags = lines[i].tags
+			self:onCommand(lines[i].prefix, lines[i].cmd, lines[i].params, lines[i].numeric)
+		end
+		self.lineTags = tags
+	end
+end
+
+
+-- Seconds of quiet that end a netsplit or netjoin storm.
+IrcClient.netStormQuiet = 1
+-- Seconds a split nick's JOINs count as its netjoin.
+IrcClient.netSplitMemory = 600
+
+local function isSplitReason(reason)
+	return reason and reason:match("^[%w%-%*]+%.[%w%-%.%*]+ [%w%-%*]+%.[%w%-%.%*]+$") ~= nil
+end
+
+-- Folds netsplit QUITs, and the JOINs of split nicks coming back, into single
+-- NETSPLIT and NETJOIN events; returns true if the line was folded in.
+-- Splits are spotted by the "server1 server2" quit reason, or by an IRCv3
+-- netsplit or netjoin batch. The event's params are: servers, count, nicks,
+-- with params.sources the nick!user@host of each, and for NETJOIN params.channels
+-- the channel of each JOIN. Any other line ends the storm first.
+function IrcClient:_netStorm(prefix, cmd, params)
+	local storm = self._storm
+	local batch = self:tag("batch")
+	if cmd == "BATCH" and params[1] then
+		local id = params[1]:sub(2)
+		local kind = params[2] and params[2]:lower()
+		if params[1]:sub(1, 1) == "+" and (kind == "netsplit" or kind == "netjoin") then
+			self._netBatches = self._netBatches or {}
+			self._netBatches[id] = kind:upper()
+			if storm then
+				self:_netStormEnd()
+			end
+			self:_netStormStart(kind:upper(), (params[3] or "*") .. " " .. (params[4] or "*"), id)
+			return true
+		elseif params[1]:sub(1, 1) == "-" and self._netBatches and self._netBatches[id] then
+			self._netBatches[id] = nil
+			if storm and storm.batch == id then
+				self:_netStormEnd()
+			end
+			return true
+		end
+	end
+	local kind, servers
+	if storm and storm.batch and batch == storm.batch then
+		if cmd == "QUIT" or cmd == "JOIN" then
+			kind, servers = storm.kind, storm.servers
+		end
+	elseif storm and storm.batch then
+		return false -- Not in the batch.
+	elseif cmd == "QUIT" and isSplitReason(params[1]) then
+		kind, servers = "NETSPLIT", params[1]
+	elseif cmd == "JOIN" and self._splitNicks then
+		local split = self._splitNicks[(self.tolower or string.lower)(nickFromSource(prefix or ""))]
+		if split and internal.milliseconds_diff(split.at, internal.milliseconds()) < self.netSplitMemory * 1000 then
+			kind, servers = "NETJOIN", split.servers
+		end
+	end
+	if not kind then
+		if storm and not storm.batch then
+			self:_netStormEnd()
+		end
+		return false
+	end
+	if storm and (kind ~= storm.kind or servers ~= storm.servers) then
+		self:_netStormEnd()
+		storm = nil
+	end
+	if not storm then
+		storm = self:_netStormStart(kind, servers)
+	end
+	local source = prefix or ""
+	table.insert(storm.sources, source)
+	table.insert(storm.nicks, nickFromSource(source))
+	if cmd == "JOIN" then
+		table.insert(storm.channels, params[1])
+	else
+		if not self._splitNicks then
+			self._splitNicks = {}
+			self:_startSplitExpiry()
+		end
+		self._splitNicks[(self.tolower or string.lower)(nickFromSource(source))] = {
+			servers = servers, at = internal.milliseconds() }
+	end
+	storm.last = internal.milliseconds()
+	return true
+end
+
+function IrcClient:_netStormStart(kind, servers, batch)
+	local storm = { kind = kind, servers = servers, batch = batch,
+		sources = {}, nicks = {}, channels = {}, last = internal.milliseconds() }
+	self._storm = storm
+	if not batch then
+		storm.timer = Timer(self.netStormQuiet, function(timer)
+			if internal.milliseconds_diff(storm.last, internal.milliseconds()) >= self.netStormQuiet * 1000 then
+				self:_netStormEnd()
+			end
+		end)
+		storm.timer:start()
+	end
+	return storm
+end
+
+function IrcClient:_netStormEnd()
+	local storm = self._storm
+	if not storm then
+		return
+	end
+	self._storm = nil
+	if storm.timer then
+		storm.timer:stop()
+	end
+	if #storm.sources == 0 then
+		return
+	end
+	local params = { storm.servers, tostring(#storm.nicks), table.concat(storm.nicks, " ") }
+	params.sources = storm.sources
+	if storm.kind == "NETJOIN" then
+		params.channels = storm.channels
+	end
+	-- Often ended from inside the next line's onCommand; the folded event isn't
+	-- that line, so it has no tags or receive time of its own.
+	local tags, receivedAt, dispatchedAt = self.lineTags, self.receivedAt, self.dispatchedAt
+	self.lineTags, self.receivedAt, self.dispatchedAt = nil, nil, nil
+	self:onCommand(self.serverName or storm.servers:match("^%S+"), storm.kind, params, nil) -- Not a numeric.
+	self.lineTags, self.receivedAt, self.dispatchedAt = tags, receivedAt, dispatchedAt
+end
+
+-- Forgets split nicks after netSplitMemory seconds, even if they never come back.
+function IrcClient:_startSplitExpiry()
+	local client = self
+	self._splitTimer = Timer(math.max(1, self.netSplitMemory / 4), function(timer)
+		local splits = client._splitNicks
+		local now = internal.milliseconds()
+		for nick, split in pairs(splits or {}) do
+			if internal.milliseconds_diff(split.at, now) >= client.netSplitMemory * 1000 then
+				splits[nick] = nil
+			end
+		end
+		if not splits or not next(splits) then
+			timer:stop()
+			client._splitNicks = nil
+			client._splitTimer = nil
+		end
+	end)
+	self._splitTimer:start()
+end
+
+
+-- Replies to queries sent with IrcClient:query, by the query command.
+-- replies are collected until one of ends, errors end the query early.
+-- For MODE, list queries such as "MODE #chan b" are under "MODE b".
+IrcClient.queryReplies = {
+	WHOIS = { replies = "276 301 307 310 311 312 313 317 319 320 330 335 338 378 379 401 671",
+		ends = "318", errors = "402 431", lastTarget = true },
+	WHOWAS = { replies = "312 314 330 338 406", ends = "369", errors = "431" },
+	WHO = { replies = "352 354", ends = "315", errors = "263 416" },
+	NAMES = { replies = "353", ends = "366" },
+	LIST = { replies = "321 322", ends = "323", errors = "263 416" },
+	MODE = { replies = "", ends = "221 324", errors = "403 442 477 502" },
+	["MODE b"] = { replies = "367", ends = "368", errors = "403 442 482" },
+	["MODE e"] = { replies = "348", ends = "349", errors = "403 442 482" },
+	["MODE I"] = { replies = "346", ends = "347", errors = "403 442 482" },
+}
+
+-- Where replies have the query's target, by numeric; the default is params[2].
+-- false for replies which don't carry it, such as the WHOX fields of 354.
+-- 352 has the channel in params[2] and the nick in params[6], WHO can ask for either.
+IrcClient.queryReplyTargets = {
+	["353"] = { 3 }, ["352"] = { 2, 6 },
+	["354"] = false, ["221"] = false, ["321"] = false, ["322"] = false, ["323"] = false,
+	["263"] = false, ["416"] = false, ["402"] = false, ["431"] = false, ["502"] = false,
+}
+
+local defaultQueryReplyTarget = { 2 }
+
+local queryNumerics = {} -- spec to { ["311"] = "reply", ["318"] = "end", ... }
+
+local function getQueryNumerics(spec)
+	local t = queryNumerics[spec]
+	if not t then
+		t = {}
+		for _, kind in ipairs({ "replies", "ends", "errors" }) do
+			for num in (spec[kind] or ""):gmatch("%S+") do
+				t[num] = kind
+			end
+		end
+		queryNumerics[spec] = t
+	end
+	return t
+end
+
+-- Sends a query line such as "WHOIS nick" and calls callback(replies, err)
+-- when its replies are done; queries can be pipelined, the server answers them in order.
+-- replies is an array of { prefix = prefix, cmd = cmd, params = params }.
+-- err is nil on success, otherwise "timeout", "disconnected" or the error reply's text.
+-- Replies to a query go to its callback instead of the on[...] handlers.
+-- timeout is in seconds (default 30). Returns the query, which can be passed to cancelQuery.
+function IrcClient:query(line, callback, timeout)
+	local cmd, args = line:match("^(%S+)%s*(.-)%s*$")
+	assert(cmd, "Empty query")
+	cmd = cmd:upper()
+	local argv = {}
+	for a in args:gmatch("%S+") do
+		table.insert(argv, a)
+	end
+	local kind = cmd
+	if cmd == "MODE" and argv[3] then
+		kind = ""
+	elseif cmd == "MODE" and argv[2] then
+		local m = argv[2]:match("^%+?(%a)$")
+		kind = m and ("MODE " .. m) or ""
+	end
+	local spec = IrcClient.queryReplies[kind]
+	if not spec then
+		error("Not a query with known replies: " .. line, 2)
+	end
+	local q = {
+		kind = kind,
+		spec = spec,
+		target = spec.lastTarget and argv[#argv] or argv[1],
+		callback = callback,
+		replies = {},
+	}
+	q.timer = Timer(timeout or 30, function(timer)
+		self:_queryDone(q, "timeout")
+	end)
+	q.timer:start()
+	table.insert(self._queries, q)
+	self:sendLine(line)
+	return q
+end
+
+-- Forgets the query, its callback is not called; later replies go to the handlers.
+function IrcClient:cancelQuery(q)
+	for i = 1, #self._queries do
+		if self._queries[i] == q then
+			table.remove(self._queries, i)
+			q.timer:stop()
+			return true
+		end
+	end
+	return false
+end
+
+function IrcClient:_queryDone(q, err)
+	if self:cancelQuery(q) and q.callback then
+		q.callback(q.replies, err)
+	end
+end
+
+-- Returns true if the reply can be for the query q, by the reply's target (see queryReplyTargets).
+-- A reply without a target, or a query for a mask or list, can be for any query.
+function IrcClient:_queryTargetMatches(q, cmd, params)
+	local where = IrcClient.queryReplyTargets[cmd]
+	if where == nil then
+		where = defaultQueryReplyTarget
+	end
+	if not where or not q.target or q.target:find("[%*%?,]") then
+		return true
+	end
+	local carried = false
+	for i = 1, #where do
+		local target = params[where[i]]
+		if target then
+			if self.strcmp(q.target, target) == 0 then
+				return true
+			end
+			carried = true
+		end
+	end
+	return not carried
+end
+
+-- Gives the reply to the oldest pending query expecting it; returns true if it did.
+-- The reply's target picks between queries of the same kind; replies for other
+-- targets, such as the NAMES after a JOIN, go to the handlers.
+function IrcClient:_queryReply(prefix, cmd, params)
+	local found, foundKind
+	for i = 1, #self._queries do
+		local q = self._queries[i]
+		local kind = getQueryNumerics(q.spec)[cmd]
+		if kind and self:_queryTargetMatches(q, cmd, params) then
+			found, foundKind = q, kind
+			break
+		end
+	end
+	if not found then
+		return false
+	end
+	table.insert(found.replies, { prefix = prefix, cmd = cmd, params = params })
+	if foundKind == "errors" then
+		self:_queryDone(found, params[#params] or cmd)
+	elseif foundKind == "ends" then
+		local err
+		for i = 1, #found.replies do
+			local num = found.replies[i].cmd
+			if num:match("^[45]%d%d$") then
+				err = found.replies[i].params[#found.replies[i].params] or num
+				break
+			end
+		end
+		self:_queryDone(found, err)
+	end
+	return true
+end
+
+-- Pending queries fail with "disconnected"; split nicks, an unfinished netsplit,
+-- CAP negotiation and open batches are forgotten.
+function IrcClient:setDisconnected(msg, code)
+	local result = SocketClientLines.setDisconnected(self, msg, code)
+	while self._queries[1] do
+		self:_queryDone(self._queries[1], "disconnected")
+	end
+	if self._splitTimer then
+		self._splitTimer:stop()
+		self._splitTimer = nil
+	end
+	self._splitNicks = nil
+	if self._storm then
+		if self._storm.timer then
+			self._storm.timer:stop()
+		end
+		self._storm = nil
+	end
+	self._capNegotiating = nil
+	self._capOffered = nil
+	self._capPending = nil
+	self._batches = nil
+	self._netBatches = nil
+	return result
+end
+
+
 function IrcClient:translate2(pattern, values)
 	return pattern:gsub("%{([^%}]*)%}", function(rawname)
 		local hasdots = "..." == rawname:sub(-3)
@@ -436,64 +1102,80 @@ function IrcClient:translate2(pattern, values)
 end
 
 
-function getServerCommandValues(commandSyntax, params, values)
-	values = values or {}
-	local paramindex = 1
-	for rawname in commandSyntax:gmatch("%{([^%}]*)%}") do
-		local hasdots = "..." == rawname:sub(-3)
-		local name
-		if hasdots then
-			name = rawname:sub(0, -4)
-		else
-			name = rawname
+-- Compiled comm_input, comm_output and readServerCommands syntax, by syntax string.
+-- Each is { template = internal.template(...), magicCmd = "$RUN" or nil }.
+templateCache = templateCache or {}
+templateCacheCount = templateCacheCount or 0
+
+-- Returns the compiled syntax, compiling it the first time it's used.
+-- For magic such as "$ECHO {1...}", the template is what follows the magic command.
+function getTemplate(syntax)
+	local t = templateCache[syntax]
+	if not t then
+		if templateCacheCount >= 1000 then
+			-- Scripts building syntax on the fly shouldn't grow this forever.
+			templateCache = {}
+			templateCacheCount = 0
 		end
-		-- print("*", name, "=", params[paramindex])
-		values[name] = params[paramindex]
-		paramindex = paramindex + 1
-		if hasdots then
-			while paramindex <= #params do
-				values[name] = values[name] .." " .. params[paramindex]
-				paramindex = paramindex + 1
+		t = {}
+		local body = syntax
+		if syntax:sub(1, 1) == '$' then
+			t.magicCmd, body = syntax:match("([^ ]+)[ ]?(.*)")
+		end
+		t.body = body
+		t.template = internal.template(body)
+		templateCache[syntax] = t
+		templateCacheCount = templateCacheCount + 1
+	end
+	return t
+end
+
+
+function getServerCommandValues(commandSyntax, params, values)
+	return getTemplate(commandSyntax).template:values(params, values)
+end
+
+
+-- Returns the {1}, {2+} and {3...} slots of the syntax as { num, rawname, plus, dots }.
+local function clientParameterSlots(t)
+	if not t.paramSlots then
+		t.paramSlots = {}
+		local slots = t.template:slots()
+		for i = 1, #slots do
+			local rawname = slots[i]
+			local num, extra = rawname:match("^(%d+)([%+]?[%.]?[%.]?[%.]?)$")
+			if num and (extra == "" or extra == "+" or extra == "...") then
+				table.insert(t.paramSlots, { num = num, rawname = rawname,
+					plus = extra == "+", dots = extra == "..." })
 			end
 		end
 	end
-	return values
+	return t.paramSlots
 end
 
 
 function getClientParameterValues(commandSyntax, strparams, values)
 	values = values or {}
+	local slots = clientParameterSlots(getTemplate(commandSyntax))
 	local lastnum = 0
-	for rawname in commandSyntax:gmatch("%{([^%}]*)%}") do
-		local num, extra = rawname:match("^(%d+)([%+]?[%.]?[%.]?[%.]?)$")
-		if num then
-			local hasplus
-			local hasdots
-			if extra == "+" then
-				hasplus = true
-			elseif extra == "..." then
-				hasdots = true
-			elseif extra ~= "" then
-				num = nil
-			end
-			if num then
-				if tonumber(num) ~= lastnum + 1 then
-					strparams = ""
-				end
-				if hasplus then
-					values[rawname] = strparams
-					strparams = ""
-				elseif hasdots then
-					values[num] = strparams
-					strparams = ""
-				else
-					local x, y = strparams:match("^([^ ]*) ?(.*)")
-					values[num] = x
-					strparams = y
-				end
-				lastnum = num
-			end
+	for i = 1, #slots do
+		local slot = slots[i]
+		local num = slot.num
+		if tonumber(num) ~= lastnum + 1 then
+			strparams = ""
+		end
+		if slot.plus then
+			values[slot.rawname] = strparams
+			strparams = ""
+		elseif slot.dots then
+			values[num] = strparams
+			strparams = ""
+		else
+			local x, y = strparams:match("^([^ ]*) ?(.*)")
+			values[num] = x
+			strparams = y
 		end
+		lastnum = num
 	end
 	return values
 end
@@ -504,7 +1186,168 @@ local function _runecho(...)
 end
 
 
-function doMagic(client, magicCmd, magicInfo)
+-- Finds the end of a Lua string literal starting at i, returns the index after it
+-- and the delimiters, or nil if code[i] doesn't start one.
+local function runStringEnd(code, i)
+	local c = code:sub(i, i)
+	if c == "'" or c == '"' then
+		local j = i + 1
+		while j <= code:len() do
+			local cj = code:sub(j, j)
+			if cj == "\\" then
+				j = j + 2
+			elseif cj == c then
+				return j + 1, c, c
+			else
+				j = j + 1
+			end
+		end
+		return code:len() + 1, c, c
+	end
+	local level = code:match("^%[(=*)%[", i)
+	if level then
+		local open, close = "[" .. level .. "[", "]" .. level .. "]"
+		local j = code:find(close, i + open:len(), true)
+		return j and j + close:len() or code:len() + 1, open, close
+	end
+end
+
+local runTemplateNames -- Set of the value names of readServerCommands, see isRunSlotName.
+
+-- Returns true if {name} in $RUN code is a template slot: a parameter number,
+-- or a value name a server command has; other braces, such as {x}, are Lua tables.
+local function isRunSlotName(name)
+	if name:match("^%d+$") then
+		return true
+	end
+	if not runTemplateNames then
+		runTemplateNames = { nick = true, chan = true, channel = true, target = true,
+			msg = true, source = true, cmd = true }
+		for _, syntax in pairs(IrcClient.readServerCommands) do
+			for name in syntax:gmatch("{([%w_]+)") do
+				runTemplateNames[name] = true
+			end
+		end
+	end
+	return runTemplateNames[name] == true
+end
+
+-- Turns the Lua code of a $RUN template into source where each {slot} in a string
+-- literal is _slot(values, client, n) instead of text spliced into the code:
+-- '<{nick}> hi' becomes ('<' .. _slot(values, client, 1) .. '> hi').
+-- Slots in code, such as "$RUN {1+}", are left as they are: their text is code.
+-- Only known names count as slots in code, so table constructors stay precompiled,
+-- unless the table is of a single known name such as {nick}.
+-- Returns the source, the slot names, and whether any slots are code.
+function compileRunTemplate(code)
+	local out, slots, codeSlots = {}, {}, false
+	local function slot(rawname)
+		table.insert(slots, rawname)
+		return "_slot(values, client, " .. #slots .. ")"
+	end
+	local i = 1
+	while i <= code:len() do
+		local c = code:sub(i, i)
+		local stop, open, close = runStringEnd(code, i)
+		if stop then
+			local body = code:sub(i + open:len(), stop - close:len() - 1)
+			if body:find("{[^}]*}") then
+				local parts = {}
+				local last = 1
+				for a, rawname, b in body:gmatch("(){([^}]*)}()") do
+					table.insert(parts, open .. body:sub(last, a - 1) .. close)
+					table.insert(parts, slot(rawname))
+					last = b
+				end
+				table.insert(parts, open .. body:sub(last) .. close)
+				table.insert(out, "(" .. table.concat(parts, " .. ") .. ")")
+			else
+				table.insert(out, code:sub(i, stop - 1))
+			end
+			i = stop
+		elseif code:sub(i, i + 1) == "--" then
+			table.insert(out, code:sub(i))
+			break
+		elseif c == "{" and code:match("^{[%w_]+%.?%.?%.?%+?}", i) then
+			codeSlots = codeSlots or isRunSlotName(code:match("^{([%w_]+)", i))
+			table.insert(out, c)
+			i = i + 1
+		else
+			table.insert(out, c)
+			i = i + 1
+		end
+	end
+	return table.concat(out), slots, codeSlots
+end
+
+runChunkCache = runChunkCache or {}
+runChunkCacheCount = runChunkCacheCount or 0
+
+-- Returns the function for a $RUN syntax from getTemplate, compiled once;
+-- it takes (client, values, echo). Returns nil and the error if it doesn't compile.
+-- If the syntax has slots in code, values is needed and each distinct code is cached.
+function getRunFunction(t, values, client)
+	if t.run == nil then
+		local source, slots, codeSlots = compileRunTemplate(t.body)
+		local slotTemplates = {}
+		for i = 1, #slots do
+			slotTemplates[i] = internal.template("{" .. slots[i] .. "}")
+		end
+		t.runSlot = function(values, client, n)
+			return slotTemplates[n]:render(values, client)
+		end
+		if codeSlots then
+			t.runTemplate = internal.template(source)
+			t.run = false
+		else
+			t.run, t.runError = loadRunFunction(source, t.runSlot, t.body)
+		end
+	end
+	if t.runTemplate then
+		local source = t.runTemplate:render(values, client)
+		local cached = runChunkCache[source]
+		if not cached then
+			if runChunkCacheCount >= 1000 then
+				runChunkCache = {}
+				runChunkCacheCount = 0
+			end
+			local fn, xerr = loadRunFunction(source, t.runSlot, source)
+			cached = { fn = fn, err = xerr }
+			runChunkCache[source] = cached
+			runChunkCacheCount = runChunkCacheCount + 1
+		end
+		return cached.fn, cached.err
+	end
+	return t.run or nil, t.runError
+end
+
+function loadRunFunction(source, slot, name)
+	local fn, xerr = loadstring("local _slot = ...; return function(client, values, echo)\n"
+		.. source .. "\nend", "RUN " .. name:sub(1, 40))
+	if fn then
+		return fn(slot)
+	end
+	return false, xerr
+end
+
+-- Does the magic of a syntax from getTemplate; $RUN runs its compiled function.
+function doMagicTemplate(client, t, values)
+	if t.magicCmd:upper() == "$RUN" then
+		local fnrun, xerr = getRunFunction(t, values, client)
+		local xok = fnrun and true
+		if fnrun then
+			xok, xerr = pcall(fnrun, client, values, _runecho)
+		end
+		if not xok then
+			io.stderr:write(" $ Error with command: ", t.magicCmd, ": ", xerr or "", "\n")
+		end
+	else
+		doMagic(client, t.magicCmd, t.template:render(values, client), values)
+	end
+end
+
+-- magicInfo is the text with its values already put in, see doMagicTemplate.
+function doMagic(client, magicCmd, magicInfo, values)
 	magicCmd = magicCmd:upper()
 	if magicCmd == "$RUN" then
 		local run = "return function(client, values, echo) \t " .. magicInfo .. " \t end"
@@ -536,13 +1379,11 @@ function IrcClient:doUserCommand(syntax_table, cmd, strparams)
 				local values = {}
 				values["cmd"] = cmd
 				getClientParameterValues(syntax, strparams, values)
-				if syntax:sub(1, 1) == '$' then
-					-- magic
-					local magicCmd, magicInfoSyntax = syntax:match("([^ ]+)[ ]?(.*)")
-					local magicInfo = self:translate2(magicInfoSyntax, values)
-					doMagic(self, magicCmd, magicInfo)
+				local t = getTemplate(syntax)
+				if t.magicCmd then
+					doMagicTemplate(self, t, values)
 				else
-					self:sendLine(self:translate2(syntax, values))
+					self:sendLine(t.template:render(values, self))
 				end
 			end
 		else
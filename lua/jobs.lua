@@ -0,0 +1,85 @@
+-- Copyright 2012-2014 Christopher E. Miller
+-- License: GPLv2, see LICENSE file.
+
+-- Job pool for CPU heavy script work, so it doesn't hold up the select loop.
+-- spawn_job("mymodule", "analyze", { text }, function(ok, result) ... end)
+-- runs require("mymodule").analyze(text) on a job thread with its own Lua state,
+-- then calls the callback from the select loop with pcall-like results.
+-- Arguments and results are copied, see workers.lua for what can be sent;
+-- jobs can't see the caller's globals, clients or sockets.
+
+
+require("workers")
+
+
+jobs_threads = jobs_threads or 2 -- Size of the pool, started by the first spawn_job.
+
+local pendingJobs = {}
+local nextJobId = 0
+local poolStarted = false
+
+
+-- Returns the job id.
+function spawn_job(module, func, args, callback)
+	assert(type(module) == "string" and type(func) == "string")
+	args = args or {}
+	if not poolStarted then
+		poolStarted = true
+		internal.job_pool_start(jobs_threads, package.path, package.cpath)
+	end
+	workerListen()
+	nextJobId = nextJobId + 1
+	local id = nextJobId
+	pendingJobs[id] = callback or false
+	local ok, err = internal.job_submit(worker_id, id, module, func,
+		workerSerialize(unpack(args, 1, args.n or #args)))
+	if not ok then
+		pendingJobs[id] = nil
+		error(err)
+	end
+	return id
+end
+
+-- Returns the number of jobs still running.
+function jobsPending()
+	local n = 0
+	for k, v in pairs(pendingJobs) do
+		n = n + 1
+	end
+	return n
+end
+
+-- Called from the mailbox with the results of a job.
+function jobDone(id, ...)
+	local callback = pendingJobs[id]
+	pendingJobs[id] = nil
+	if callback then
+		callback(...)
+	end
+end
+
+-- Finishes the queued jobs and stops the pool.
+function stopJobs()
+	if poolStarted and worker_id == 0 then
+		internal.job_pool_stop()
+		poolStarted = false
+	end
+end
+
+
+-- Runs in the job threads, returns the message for jobDone.
+function jobRun(id, module, func, args)
+	local results = { pcall(function(...)
+		local m = require(module)
+		local f = type(m) == "table" and m[func] or _G[func]
+		if type(f) ~= "function" then
+			error("No function " .. func .. " in " .. module)
+		end
+		return f(...)
+	end, workerDeserialize(args)) }
+	local ok, msg = pcall(workerSerialize, id, unpack(results, 1, table.maxn(results)))
+	if not ok then
+		return workerSerialize(id, false, msg)
+	end
+	return msg
+end
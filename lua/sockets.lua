@@ -122,6 +122,12 @@ function SocketClient:linger(seconds)
 	return internal.socket_linger(self._sock, seconds)
 end
 
+-- keepalive(idle [, interval, count [, userTimeoutMs]])
+-- Set idle to false to disable TCP keepalive.
+function SocketClient:keepalive(idle, interval, count, userTimeoutMs)
+	return internal.socket_keepalive(self._sock, idle, interval, count, userTimeoutMs)
+end
+
 -- Lower level. Called when the socket can send again.
 -- Returns true if more data needs to be sent.
 function SocketClient:onCanWrite()
@@ -163,7 +169,7 @@ function SocketClient:onCanRead()
 		return "-"
 	end
 	-- internal.console_print("INPUT: ", data, "\n");
-	self:onReceive(data)
+	self:onReceive(data, xmsg) -- On success xmsg is the arrival time.
 end
 
 -- Disconnect sends/receives on the socket.
@@ -175,7 +181,8 @@ function SocketClient:disconnect(errmsg)
 	self:setDisconnected(errmsg)
 end
 
-function SocketClient:onReceive(data)
+-- arrival is when the data reached the machine, see internal.timestamp()
+function SocketClient:onReceive(data, arrival)
 end
 
 function SocketClient:onConnected()
@@ -265,25 +272,26 @@ function SocketClientLines:init(socket)
 end
 
 -- The line variable does not contain newline characters.
-function SocketClientLines:onReceiveLine(line)
+-- arrival is when the end of the line reached the machine.
+function SocketClientLines:onReceiveLine(line, arrival)
 end
 
-local function _checksocklinebuf(self)
+local function _checksocklinebuf(self, arrival)
 	while true do
 		local one, two, line = self._linebuf:find("([^\r\n]*)\r?\n")
 		if line then
 			self._linebuf = self._linebuf:sub(two + 1)
-			self:onReceiveLine(line)
+			self:onReceiveLine(line, arrival)
 		else
 			break
 		end
 	end
 end
 
-function SocketClientLines:onReceive(data)
+function SocketClientLines:onReceive(data, arrival)
 	-- internal.console_print("INPUT: ", data, "\n");
 	self._linebuf = self._linebuf .. data
-	_checksocklinebuf(self)
+	_checksocklinebuf(self, arrival)
 end
 
 function SocketClientLines:setDisconnected(msg, code)
@@ -308,12 +316,24 @@ SelectManagerBase = class()
 
 function SelectManagerBase:init()
 	self._events = {}
+	self.stdinLineBudget = 256 -- Most lines of standard input handled per select.
 end
 
 -- If this function is overridden, standard input is automatically read.
 function SelectManagerBase:onStandardInput(input)
 end
 
+-- Called with an array of lines available on standard input,
+-- each still ending in its newline. Can be overridden to handle a batch at once,
+-- otherwise standard input is automatically read if onStandardInput is overridden.
+-- The default calls onStandardInput for each line; lines.done is how many were handled.
+function SelectManagerBase:onStandardInputLines(lines)
+	for i = (lines.done or 0) + 1, #lines do
+		lines.done = i
+		self:onStandardInput(lines[i])
+	end
+end
+
 function SelectManagerBase:onRead(sock)
 end
 
@@ -370,19 +390,30 @@ end
 function SelectManagerBase:onBeforeSelect()
 end
 
--- If timers were included, they are automatically handled while in the select loop.
+-- If timers were included, they are automatically handled while in the select loop,
+-- and so are coroutines waiting in async.lua if it was included.
 -- Any errors raised from events (socket, timer, stdin) break out of the loop function.
 -- Returns true if the loop can be re-entered.
 function SelectManagerBase:loop()
 	-- self._stop = nil
 	self._stop = self._stopAll
 
-	if self.onStandardInput == SelectManagerBase.onStandardInput then
+	if self.onStandardInput == SelectManagerBase.onStandardInput
+			and self.onStandardInputLines == SelectManagerBase.onStandardInputLines then
 		self._events["stdin"] = nil
 	else
 		self._events["stdin"] = "r"
 	end
 
+	if self._stdinLines then
+		-- A handler raised an error partway through these lines, finish them first.
+		local lines = self._stdinLines
+		self._stdinLines = nil
+		if lines.done then
+			self:onStandardInputLines(lines)
+		end
+	end
+
 	local lasttime = nil -- for timer_tick
 	local tickresolution = 100
 
@@ -407,6 +438,20 @@ function SelectManagerBase:loop()
 		else
 			lasttime = nil
 		end
+		if async_tick then
+			-- Coroutines waiting in async.lua
+			local asyncwait = async_tick()
+			if asyncwait and (microwait == -1 or asyncwait < microwait) then
+				microwait = asyncwait
+			end
+		end
+		if internal.console_flush then
+			-- Console output buffered by console_buffer, see -outbuf.
+			local flushwait = internal.console_flush()
+			if flushwait and (microwait == -1 or flushwait < microwait) then
+				microwait = flushwait
+			end
+		end
 		--[[ if microwait ~= -1 then
 			io.stderr:write(" t=" .. microwait .. " ")
 		end --]]
@@ -418,7 +463,7 @@ function SelectManagerBase:loop()
 		end
 		print("", "select with " .. nevents .. " events, timeout = " .. microwait)
 		--]]
-		local selresult, xmsg, xerrcode = internal.socket_select(self._events, microwait);
+		local selresult, xmsg, xerrcode = internal.socket_select(self._events, microwait, self.stdinLineBudget);
 		if not selresult then
 			if xerrcode then
 				error(xmsg .. " [" .. xerrcode .. "]")
@@ -428,7 +473,13 @@ function SelectManagerBase:loop()
 		if selresult ~= "timeout" then
 			for k, v in pairs(selresult) do
 				if k == "stdin" then
-					self:onStandardInput(v)
+					if type(v) == "table" then
+						self._stdinLines = v
+						self:onStandardInputLines(v)
+						self._stdinLines = nil
+					else
+						self:onStandardInput(v)
+					end
 				else
 					for i = 1, string.len(v) do
 						local ch = v:sub(i, i)
@@ -443,6 +494,10 @@ function SelectManagerBase:loop()
 		end
 	end
 
+	if internal.console_flush then
+		internal.console_flush(true)
+	end
+
 	return not self._stopAll
 end
 
@@ -58,6 +58,10 @@ function _tsl_insert(queue, insert)
 end
 
 function _timersendline(client, line, priority)
+	if client.receivedAt and client._recordReply then
+		-- Count the reply as made now, the flood delay is on purpose.
+		client:_recordReply()
+	end
 	--[[
 	if priority == true then
 		-- No max for priority (for now)
@@ -63,20 +63,44 @@ end
 
 event = class()
 
+-- Each event recompiles its handler list when its own handlers change (self._version).
+-- Handlers named by a string are still looked up in _G on every call,
+-- so redefining the global (say by reloading a script) takes effect at once.
+local function namedHandler(name)
+	return function(...)
+		local f = _G[name]
+		if not f then
+			-- error("Unable to call string as function, not an existing function: " .. name)
+			error("Unable to call string as function, not a global function: " .. name)
+		end
+		return f(...)
+	end
+end
+
+-- Returns the handlers as an array of functions.
+function event:compiled()
+	if self._compiledVersion ~= self._version then
+		local fns = {}
+		for i = 1, #self do
+			local f = self[i]
+			if type(f) == "string" then
+				f = namedHandler(f)
+			end
+			fns[i] = f
+		end
+		self._compiled = fns
+		self._compiledVersion = self._version
+	end
+	return self._compiled
+end
+
 function event:init()
+	self._version = 0
 	local mt = getmetatable(self)
 	mt.__call = function(e, ...)
-		for i = 1, #e do
-			local f = e[i]
-			if type(f) == "string" then
-				local s = f
-				f = _G[s]
-				if not f then
-					-- error("Unable to call string as function, not an existing function: " .. s)
-					error("Unable to call string as function, not a global function: " .. s)
-				end
-			end
-			local x = f(...)
+		local fns = e:compiled()
+		for i = 1, #fns do
+			local x = fns[i](...)
 			if false == x then
 				break
 			end
@@ -96,6 +120,7 @@ function event:add(func)
 			return
 		end
 	end
+	self._version = self._version + 1
 	table.insert(self, func)
 end
 
@@ -103,6 +128,7 @@ end
 -- If it already exists, it is moved to the index.
 function event:insert(index, func)
 	assert(index and func)
+	self._version = self._version + 1
 	for i = 1, #self do
 		if func == self[i] then
 			if i ~= index then
@@ -116,6 +142,7 @@ function event:insert(index, func)
 end
 
 function event:remove(func)
+	self._version = self._version + 1
 	for i = 1, #self do
 		if func == self[i] then
 			table.remove(self, i)
@@ -0,0 +1,182 @@
+-- Copyright 2012-2014 Christopher E. Miller
+-- License: GPLv2, see LICENSE file.
+
+-- Worker threads, each an event loop with its own Lua state running the same script.
+-- Worker 0 is the main thread; IRC connections are spread across the workers,
+-- and scripts on different workers talk to each other with workerSend.
+-- Messages can contain nil, booleans, numbers, strings and tables of those.
+
+
+require("irccmd_internal")
+require("utils")
+
+
+worker_id = worker_id or 0 -- Set for the other workers before their script runs.
+worker_count = worker_count or 1
+WORKER_JOBS = -1 -- Sender of job results, and worker_id of the job threads (see jobs.lua).
+
+-- workerMessage(from, ...) is called with the values from workerSend.
+workerMessage = workerMessage or event()
+
+-- Messages starting with one of these names go to its function instead of workerMessage.
+-- workerCommands[name](from, ...)
+workerCommands = workerCommands or {}
+
+
+local function serializeValue(v, out)
+	local t = type(v)
+	if t == "string" then
+		out[#out + 1] = string.format("%q", v)
+	elseif t == "number" then
+		if v ~= v then
+			out[#out + 1] = "0/0"
+		elseif v == 1/0 or v == -1/0 then
+			out[#out + 1] = v > 0 and "1/0" or "-1/0"
+		else
+			out[#out + 1] = string.format("%.17g", v)
+		end
+	elseif t == "boolean" or t == "nil" then
+		out[#out + 1] = tostring(v)
+	elseif t == "table" then
+		out[#out + 1] = "{"
+		for k, x in pairs(v) do
+			out[#out + 1] = "["
+			serializeValue(k, out)
+			out[#out + 1] = "]="
+			serializeValue(x, out)
+			out[#out + 1] = ","
+		end
+		out[#out + 1] = "}"
+	else
+		error("Cannot send a " .. t .. " to another worker")
+	end
+end
+
+function workerSerialize(...)
+	local out = { "return " }
+	for i = 1, select('#', ...) do
+		if i > 1 then
+			out[#out + 1] = ","
+		end
+		serializeValue((select(i, ...)), out)
+	end
+	return table.concat(out)
+end
+
+function workerDeserialize(data)
+	local f = assert(loadstring(data, "=worker message"))
+	setfenv(f, {})
+	return f()
+end
+
+
+-- Returns which worker owns the key, such as a server address.
+function workerFor(key)
+	return workerHash(key) % worker_count
+end
+
+-- A stable hash of the string, the same in every worker.
+function workerHash(key)
+	local h = 0
+	for i = 1, #key do
+		h = (h * 31 + key:byte(i)) % 2147483648
+	end
+	return h
+end
+
+
+function workerSend(to, ...)
+	return internal.worker_send(to, worker_id, workerSerialize(...))
+end
+
+-- Sends to every worker but this one.
+function workerBroadcast(...)
+	local data = workerSerialize(...)
+	for i = 0, worker_count - 1 do
+		if i ~= worker_id then
+			internal.worker_send(i, worker_id, data)
+		end
+	end
+end
+
+
+-- Lets a SelectManager wait for this worker's messages.
+WorkerMailbox = class()
+
+function WorkerMailbox:init(id)
+	self.id = id or worker_id
+	self._sock = assert(internal.worker_mailbox(self.id))
+	self.maxMessages = 256 -- Most messages handled per select.
+end
+
+function WorkerMailbox:valid()
+	return true
+end
+
+function WorkerMailbox:needRead()
+	return true
+end
+
+function WorkerMailbox:needWrite()
+	return false
+end
+
+function WorkerMailbox:onCanRead()
+	local msgs, froms = internal.worker_receive(self.id, self.maxMessages)
+	if msgs then
+		for i = 1, #msgs do
+			self:onMessage(froms[i], workerDeserialize(msgs[i]))
+		end
+	end
+end
+
+function WorkerMailbox:onMessage(from, ...)
+	if from == WORKER_JOBS then
+		jobDone(...)
+		return
+	end
+	local command = workerCommands[(...)]
+	if command then
+		return command(from, select(2, ...))
+	end
+	workerMessage(from, ...)
+end
+
+workerCommands._stopWorker = function(from)
+	if manager then
+		manager:stop("all")
+	end
+end
+
+
+-- Adds this worker's mailbox to the manager, once.
+function workerListen()
+	if not workerMailbox then
+		workerMailbox = WorkerMailbox()
+		manager:add(workerMailbox)
+	end
+	return workerMailbox
+end
+
+
+-- Starts workers 1 to count-1 running the script in argv (see irccmd_startup).
+function startWorkers(count, argv)
+	assert(worker_id == 0, "Only the main thread starts workers")
+	worker_count = count
+	for i = 1, count - 1 do
+		assert(internal.worker_start(i, argv, package.path, package.cpath))
+	end
+end
+
+-- Asks the other workers to finish and waits for them.
+function stopWorkers()
+	if worker_id ~= 0 then
+		return
+	end
+	for i = 1, worker_count - 1 do
+		internal.worker_send(i, 0, workerSerialize("_stopWorker"))
+	end
+	for i = 1, worker_count - 1 do
+		internal.worker_join(i)
+	end
+end
@@ -5,6 +5,8 @@ solution "irccmd"
 		kind "SharedLib"
 		language "C"
 		files { "**.h", "**.c" }
+		excludes { "src/lua-5.1/lcoco.c" } -- Part of lua, needs its internals.
+		excludes { "examples/**" }
 
 		targetname "irccmd_internal"
 		targetprefix ""
@@ -28,6 +30,9 @@ solution "irccmd"
 			links { "lua" }
 		end
 
+		configuration "not windows"
+			links { "pthread", "rt" }
+
 		configuration "Debug"
 			defines { "_DEBUG" }
 			flags { "Symbols" }
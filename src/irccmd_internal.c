@@ -21,6 +21,9 @@
 
 #include "frandom.h"
 #include "utf8v.h"
+#include "workers.h"
+#include "outbuf.h"
+#include "ircring.h"
 
 #include <lauxlib.h>
 #include <lualib.h>
@@ -33,7 +36,7 @@
 typedef int socklen_t;
 #endif
 
-static FRandom frand;
+static FRandom frand; /* For the stdin socket; Lua gets one per state, see _stateFRandom. */
 
 
 #define LuaReturn(r, NumArgs) (-(NumArgs) + (r) - 1)
@@ -153,9 +156,12 @@ static int _socketsCleanup()
 #else
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 #include <errno.h>
 #include <unistd.h>
+#include <poll.h>
 #define _INVALID_SOCKET -1
 #define _SOCKET_ERROR -1
 typedef int socket_t;
@@ -204,6 +210,29 @@ static int luafunc_random(lua_State *L)
 }
 
 
+static char _frandomKey; /* Registry key of the state's FRandom. */
+
+/**	Each Lua state has its own generator, so worker threads don't share one. */
+static FRandom *_stateFRandom(lua_State *L)
+{
+	FRandom *fr;
+	lua_pushlightuserdata(L, &_frandomKey);
+	lua_rawget(L, LUA_REGISTRYINDEX);
+	fr = (FRandom*)lua_touserdata(L, -1);
+	lua_pop(L, 1);
+	if(!fr)
+	{
+		fr = (FRandom*)lua_newuserdata(L, sizeof(FRandom));
+		frandom_init(fr, (long)(rrandom() ^ (unsigned long)(size_t)L));
+		lua_pushlightuserdata(L, &_frandomKey);
+		lua_pushvalue(L, -2);
+		lua_rawset(L, LUA_REGISTRYINDEX);
+		lua_pop(L, 1);
+	}
+	return fr;
+}
+
+
 /**	lower is inclusive, upper is exclusive.
 	x = frandom()
 	x = frandom(upper)
@@ -211,6 +240,7 @@ static int luafunc_random(lua_State *L)
 */
 static int luafunc_frandom(lua_State *L)
 {
+	FRandom *frand = _stateFRandom(L);
 	unsigned long rn;
 	if(lua_isnumber(L, 1))
 	{
@@ -224,13 +254,13 @@ static int luafunc_frandom(lua_State *L)
 				_programError("luafunc_frandom upper must be greater than lower", 0);
 				return 0;
 			}
-			rn = frandom_bounds(&frand, lower, upper);
+			rn = frandom_bounds(frand, lower, upper);
 		}
 		else
 		{
 			/* 1 arg */
 			unsigned long upper = (unsigned long)lua_tonumber(L, 1);
-			rn = frandom(&frand);
+			rn = frandom(frand);
 			if(upper > 0)
 			{
 				rn %= upper;
@@ -245,14 +275,17 @@ static int luafunc_frandom(lua_State *L)
 	else
 	{
 		/* 0 args */
-		rn = frandom(&frand);
+		rn = frandom(frand);
 	}
 	lua_pushnumber(L, rn);
 	return 1; /* Number of return values. */
 }
 
 
-/**	Note: milliseconds() is not very accurate and is subject to overflow! */
+/**	Note: milliseconds() is not very accurate and is subject to overflow!
+	It's a monotonic clock where there is one, so only differences mean anything;
+	setting the system time doesn't make timers and timeouts fire or stall.
+*/
 #ifdef _ON_WINDOWS_
 #include <windows.h>
 #define milliseconds GetTickCount
@@ -260,10 +293,17 @@ static int luafunc_frandom(lua_State *L)
 #include <sys/time.h>
 static LL_INLINE unsigned long milliseconds()
 {
-	struct timeval tv;
-	if(-1 == gettimeofday(&tv, NULL))
-		return 0;
-	return (unsigned long)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+#ifdef CLOCK_MONOTONIC
+	struct timespec ts;
+	if(0 == clock_gettime(CLOCK_MONOTONIC, &ts))
+		return (unsigned long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+	{
+		struct timeval tv;
+		if(-1 == gettimeofday(&tv, NULL))
+			return 0;
+		return (unsigned long)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+	}
 }
 #endif
 
@@ -296,6 +336,40 @@ static int luafunc_milliseconds_diff(lua_State *L)
 }
 
 
+/**	Wall clock time in seconds since the epoch, with sub-second precision.
+	Same clock as the kernel receive timestamps from socket_receive.
+*/
+static double timestamp()
+{
+#ifdef _ON_WINDOWS_
+	FILETIME ft;
+	ULARGE_INTEGER t;
+	GetSystemTimeAsFileTime(&ft);
+	t.LowPart = ft.dwLowDateTime;
+	t.HighPart = ft.dwHighDateTime;
+	return (double)(t.QuadPart - 116444736000000000ULL) / 10000000.0;
+#elif defined(CLOCK_REALTIME)
+	struct timespec ts;
+	if(0 == clock_gettime(CLOCK_REALTIME, &ts))
+		return (double)ts.tv_sec + (double)ts.tv_nsec / 1000000000.0;
+	return 0;
+#else
+	struct timeval tv;
+	if(-1 == gettimeofday(&tv, NULL))
+		return 0;
+	return (double)tv.tv_sec + (double)tv.tv_usec / 1000000.0;
+#endif
+}
+
+
+/**	x = timestamp() */
+static int luafunc_timestamp(lua_State *L)
+{
+	lua_pushnumber(L, timestamp());
+	return 1; /* Number of return values. */
+}
+
+
 static void addrhintsdefaults(struct addrinfo *paddrhints)
 {
 	memset(paddrhints, 0, sizeof(struct addrinfo));
@@ -489,6 +563,10 @@ static int luafunc_socket_connect(lua_State *L)
 #if defined(__APPLE__)
 				setsockopt(sock, SOL_SOCKET, SO_NOSIGPIPE, (void *)&reuse, sizeof(int));
 #endif
+#if defined(SO_TIMESTAMPNS)
+				/* Have the kernel stamp arriving data, see socket_receive. */
+				setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPNS, (void *)&reuse, sizeof(int));
+#endif
 
 				if(_SOCKET_ERROR == connect(sock, itaddr->ai_addr, itaddr->ai_addrlen))
 				{
@@ -929,6 +1007,72 @@ static int luafunc_socket_linger(lua_State *L)
 }
 
 
+/**	true = socket_keepalive(socket, idle [, interval, count [, user_timeout]])
+	Set idle to false to disable keepalive.
+	idle is the seconds of silence before the first probe,
+	interval is the seconds between probes and count is how many unanswered probes drop the connection.
+	user_timeout is the milliseconds sent data may remain unacknowledged before the connection is dropped.
+	Options not supported by the platform are ignored.
+*/
+static int luafunc_socket_keepalive(lua_State *L)
+{
+	socket_t sock;
+	int on = 1;
+
+	if(!lua_isnumber(L, 1))
+	{
+		badargs:
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, "Invalid arguments (socket_keepalive)");
+		lua_pushnil(L);
+		return 3; /* Number of return values. */
+	}
+	sock = lua_tointeger(L, 1);
+
+	if(lua_isboolean(L, 2))
+	{
+		if(lua_toboolean(L, 2))
+			goto badargs; /* True isn't valid. */
+		on = 0;
+	}
+	else if(!lua_isnumber(L, 2) || lua_tointeger(L, 2) <= 0)
+	{
+		goto badargs;
+	}
+	if(_SOCKET_ERROR == setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, SOCKOPTVAL(&on), sizeof(on)))
+	{
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, "Unable to set socket keepalive");
+		lua_pushinteger(L, _lastSocketError);
+		return 3; /* Number of return values. */
+	}
+	if(on)
+	{
+		int x = lua_tointeger(L, 2);
+#if defined(TCP_KEEPIDLE)
+		setsockopt(sock, IPPROTO_TCP, TCP_KEEPIDLE, SOCKOPTVAL(&x), sizeof(x));
+#elif defined(TCP_KEEPALIVE)
+		setsockopt(sock, IPPROTO_TCP, TCP_KEEPALIVE, SOCKOPTVAL(&x), sizeof(x));
+#endif
+#ifdef TCP_KEEPINTVL
+		if(lua_isnumber(L, 3) && (x = lua_tointeger(L, 3)) > 0)
+			setsockopt(sock, IPPROTO_TCP, TCP_KEEPINTVL, SOCKOPTVAL(&x), sizeof(x));
+#endif
+#ifdef TCP_KEEPCNT
+		if(lua_isnumber(L, 4) && (x = lua_tointeger(L, 4)) > 0)
+			setsockopt(sock, IPPROTO_TCP, TCP_KEEPCNT, SOCKOPTVAL(&x), sizeof(x));
+#endif
+#ifdef TCP_USER_TIMEOUT
+		if(lua_isnumber(L, 5) && (x = lua_tointeger(L, 5)) >= 0)
+			setsockopt(sock, IPPROTO_TCP, TCP_USER_TIMEOUT, SOCKOPTVAL(&x), sizeof(x));
+#endif
+		(void)x;
+	}
+	lua_pushboolean(L, 1);
+	return 1; /* Number of return values. */
+}
+
+
 #if 0
 /**	true = socket_reuseaddr(socket, bool)
 */
@@ -1062,9 +1206,11 @@ badarg:
 }
 
 
-/**	data = socket_receive(socket [, flags [, maxBytes]])
+/**	data, arrival = socket_receive(socket [, flags [, maxBytes]])
 	Returns nil on error; false on connection close, or data actually received.
 	data can contain embedded nul bytes.
+	arrival is when the kernel received the data (see timestamp()),
+	or the current time if the socket has no receive timestamps.
 	flags can be nil or one of the strings: NONE (default), OOB, PEEK, DONTROUTE.
 	NOSIGNAL (don't send SIGPIPE signal) is assumed.
 	maxBytes can be specified to prevent reading more than this many bytes; must be > 0.
@@ -1076,6 +1222,7 @@ static int luafunc_socket_receive(lua_State *L)
 	int flags = 0;
 	int maxBytes = sizeof(buf);
 	int result;
+	double arrival = 0;
 	if(!lua_isnumber(L, 1))
 	{
 badarg:
@@ -1111,7 +1258,37 @@ badarg:
 		if(maxBytes > sizeof(buf))
 			maxBytes = sizeof(buf);
 	}
+#if defined(SO_TIMESTAMPNS)
+	{
+		struct iovec iov;
+		struct msghdr msg;
+		struct cmsghdr *cmsg;
+		char cbuf[CMSG_SPACE(sizeof(struct timespec))];
+		iov.iov_base = buf;
+		iov.iov_len = maxBytes;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = cbuf;
+		msg.msg_controllen = sizeof(cbuf);
+		result = recvmsg(sock, &msg, flags);
+		if(result > 0)
+		{
+			for(cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+			{
+				if(SOL_SOCKET == cmsg->cmsg_level && SCM_TIMESTAMPNS == cmsg->cmsg_type)
+				{
+					struct timespec ts;
+					memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+					arrival = (double)ts.tv_sec + (double)ts.tv_nsec / 1000000000.0;
+					break;
+				}
+			}
+		}
+	}
+#else
 	result = recv(sock, buf, maxBytes, flags);
+#endif
 	if(_SOCKET_ERROR == result)
 	{
 		lua_pushnil(L);
@@ -1127,7 +1304,8 @@ badarg:
 		return 3; /* Number of return values. */
 	}
 	lua_pushlstring(L, buf, result);
-	return 1; /* Number of return values. */
+	lua_pushnumber(L, arrival ? arrival : timestamp());
+	return 2; /* Number of return values. */
 }
 
 
@@ -1174,7 +1352,135 @@ static DWORD WINAPI _stdinthreadproc(LPVOID lpParameter)
 int _stdinOpen = 1;
 
 
-/**	result = socket_select(sockets [, microseconds])
+#ifndef _ON_WINDOWS_
+/*	Standard input is read in large chunks, so a fast pipe delivers every
+	complete line per select instead of one. It stays blocking: its file flags
+	are shared with stdout and stderr on a terminal, so each read waits on poll.
+	At most STDIN_BUF_MAX bytes are buffered, then the pipe pushes back.
+*/
+#define STDIN_READ_CHUNK (1024 * 64)
+#define STDIN_READ_MAX (1024 * 1024) /* Per select, so sockets still get a turn. */
+#define STDIN_BUF_MAX (1024 * 1024 * 4)
+#define STDIN_DEFAULT_LINE_BUDGET 256
+
+static char *_stdinbuf = NULL;
+static size_t _stdinbuflen = 0, _stdinbufcap = 0;
+static int _stdinEof = 0;
+
+
+/**	Returns nonzero if a full line (or the end of input) is already buffered. */
+static int _stdinHasLine(void)
+{
+	if(_stdinEof || _stdinbuflen >= STDIN_BUF_MAX)
+		return 1;
+	return _stdinbuflen && memchr(_stdinbuf, '\n', _stdinbuflen);
+}
+
+
+/**	Returns the number of complete lines buffered, counting no further than max. */
+static int _stdinCountLines(int max)
+{
+	const char *p = _stdinbuf, *end = _stdinbuf + _stdinbuflen;
+	int nlines = 0;
+	while(nlines < max && p < end && (p = (const char*)memchr(p, '\n', end - p)))
+	{
+		nlines++;
+		p++;
+	}
+	return nlines;
+}
+
+
+/**	Returns nonzero if standard input can be read now without blocking. */
+static int _stdinReadable(void)
+{
+	struct pollfd pfd;
+	pfd.fd = fileno(stdin);
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	return 1 == poll(&pfd, 1, 0) && (pfd.revents & (POLLIN | POLLHUP | POLLERR | POLLNVAL));
+}
+
+
+/**	Reads whatever standard input has ready, without blocking. */
+static void _stdinFill(void)
+{
+	size_t total = 0;
+	while(!_stdinEof && total < STDIN_READ_MAX && _stdinbuflen < STDIN_BUF_MAX)
+	{
+		ssize_t got;
+		size_t want = STDIN_READ_CHUNK;
+		if(_stdinbufcap - _stdinbuflen < STDIN_READ_CHUNK)
+		{
+			size_t newcap = _stdinbufcap ? _stdinbufcap * 2 : STDIN_READ_CHUNK * 2;
+			char *newbuf;
+			if(newcap > STDIN_BUF_MAX)
+				newcap = STDIN_BUF_MAX;
+			newbuf = (char*)realloc(_stdinbuf, newcap);
+			if(!newbuf)
+				break;
+			_stdinbuf = newbuf;
+			_stdinbufcap = newcap;
+		}
+		if(want > _stdinbufcap - _stdinbuflen)
+			want = _stdinbufcap - _stdinbuflen;
+		if(!_stdinReadable())
+			break;
+		got = read(fileno(stdin), _stdinbuf + _stdinbuflen, want);
+		if(got > 0)
+		{
+			_stdinbuflen += got;
+			total += got;
+		}
+		else if(got < 0 && (EINTR == errno || EAGAIN == errno || EWOULDBLOCK == errno))
+		{
+			break; /* Try again next select. */
+		}
+		else
+		{
+			_stdinEof = 1; /* End of input, or an error which won't go away. */
+		}
+	}
+}
+
+
+/**	Pushes an array of up to budget buffered lines, each still ending in its newline.
+	A trailing line without a newline is only included at the end of input.
+	Returns the number of lines; nothing is pushed when there are none.
+*/
+static int _stdinPushLines(lua_State *L, int budget)
+{
+	size_t start = 0;
+	int nlines = 0;
+	while(nlines < budget && start < _stdinbuflen)
+	{
+		const char *nl = (const char*)memchr(_stdinbuf + start, '\n', _stdinbuflen - start);
+		size_t end;
+		if(nl)
+			end = (nl - _stdinbuf) + 1;
+		else if(_stdinEof || (!start && _stdinbuflen >= STDIN_BUF_MAX))
+			end = _stdinbuflen; /* Also split a line too long to buffer. */
+		else
+			break;
+		if(!nlines)
+			lua_newtable(L);
+		lua_pushlstring(L, _stdinbuf + start, end - start);
+		lua_rawseti(L, -2, ++nlines);
+		start = end;
+	}
+	if(start)
+	{
+		_stdinbuflen -= start;
+		memmove(_stdinbuf, _stdinbuf + start, _stdinbuflen);
+	}
+	if(_stdinEof && !_stdinbuflen)
+		_stdinOpen = 0;
+	return nlines;
+}
+#endif
+
+
+/**	result = socket_select(sockets [, microseconds [, stdinLines]])
 	sockets: sockets to check for events; may be limited to 64 sockets.
 	sockets is an array such that array[socket] = events_str
 	events_str is a string combination of one or more of:
@@ -1184,7 +1490,10 @@ int _stdinOpen = 1;
 	microseconds can be set to an integer wait timeout, or nil or -1 for maximum timeout.
 	Returns array of sockets with events, "timeout" if the time elapsed, (nil,msg,code) on error.
 	Key "stdin" with value "r" can be specified to wait for standard input.
-		On "stdin" event, key "stdin" will have value "<line>"
+		On "stdin" event, key "stdin" will have an array of lines, each ending in "\n"
+		except possibly the last line of input; at most stdinLines (default 256) lines
+		are returned at a time, the rest are returned by the next calls without waiting.
+		On Windows the value is instead a string with one line.
 */
 static int luafunc_socket_select(lua_State *L)
 {
@@ -1203,8 +1512,12 @@ static int luafunc_socket_select(lua_State *L)
 #ifdef _ON_WINDOWS_
 	stdinsock = _stdinsock;
 #else
+	int stdin_budget = STDIN_DEFAULT_LINE_BUDGET;
+	int stdin_buffered = 0;
 	/* stdinsock = 0; */
 	stdinsock = fileno(stdin);
+	if(lua_isnumber(L, 3) && lua_tointeger(L, 3) > 0)
+		stdin_budget = lua_tointeger(L, 3);
 #endif
 
 	if(lua_isnumber(L, 2))
@@ -1296,14 +1609,24 @@ static int luafunc_socket_select(lua_State *L)
 				_stdinthread = CreateThread(NULL, 0, &_stdinthreadproc, NULL, 0, NULL);
 			}
 			FD_SET(_stdinsock, &reads);
+			preads = &reads;
 		}
 	}
 #else
 	if(want_stdin)
 	{
 		FD_SET(stdinsock, &reads);
+		preads = &reads;
 		if(stdinsock > n)
 			n = stdinsock;
+		if(_stdinHasLine())
+		{
+			/* Lines left over from the last call, don't wait. */
+			stdin_buffered = 1;
+			tv.tv_sec = 0;
+			tv.tv_usec = 0;
+			ptv = &tv;
+		}
 	}
 #endif
 
@@ -1331,6 +1654,15 @@ static int luafunc_socket_select(lua_State *L)
 	d_nreads = 0, d_nwrites = 0, d_nerrors = 0;
 #endif
 
+#ifndef _ON_WINDOWS_
+	if(stdin_buffered && !FD_ISSET(stdinsock, &reads))
+	{
+		/* Report the buffered lines as a read event. */
+		FD_SET(stdinsock, &reads);
+		result++;
+	}
+#endif
+
 	if(!result)
 	{
 		lua_pushstring(L, "timeout");
@@ -1414,14 +1746,15 @@ static int luafunc_socket_select(lua_State *L)
 				lua_pushstring(L, want_stdin); /* Index */
 				lua_pushlstring(L, cbuf, recvlen); /* Value */
 #else
-				char cbuf[1024 * 4];
-				if(!fgets(cbuf, sizeof(cbuf), stdin) || !cbuf[0])
+				if(_stdinCountLines(stdin_budget) < stdin_budget)
+					_stdinFill();
+				lua_pushstring(L, want_stdin); /* Index */
+				if(!_stdinPushLines(L, stdin_budget))
 				{
-					_stdinOpen = 0;
+					lua_pop(L, 1);
 					goto skip_current;
 				}
-				lua_pushstring(L, want_stdin); /* Index */
-				lua_pushstring(L, cbuf); /* Value */
+				/* Value is the array of lines. */
 #endif
 				want_stdin = NULL; /* Clear it, don't want to get it twice (like if user specifies fd 0). */
 			}
@@ -1442,20 +1775,33 @@ static int luafunc_socket_select(lua_State *L)
 static void lua_print_args(lua_State *L, FILE *f)
 {
 	int iarg;
+#ifndef _ON_WINDOWS_
+	flockfile(f); /* Lines from worker threads don't interleave. */
+#endif
 	for(iarg = 1; !lua_isnone(L, iarg); iarg++)
 	{
-		const char *s = lua_tostring(L, iarg); /* Convert to string, or return NULL. */
+		size_t len;
+		const char *s = lua_tolstring(L, iarg, &len); /* Convert to string, or return NULL. */
 		if(s)
 		{
-			fputs(s, f);
+			fwrite(s, 1, len, f); /* Not fputs, output may be binary such as msgpack. */
 		}
 	}
+#ifndef _ON_WINDOWS_
+	funlockfile(f);
+#endif
 }
 
 
-/**	*/
+/**	console_print(...)
+	Output is buffered after console_buffer is called, see outbuf.h.
+*/
 static int luafunc_console_print(lua_State *L)
 {
+#ifdef HAS_OUTBUF
+	if(outbuf_print(L))
+		return 0; /* Number of return values. */
+#endif
 	lua_print_args(L, stdout);
 	return 0; /* Number of return values. */
 }
@@ -1498,17 +1844,64 @@ static int luafunc_irc_input(lua_State *L)
 }
 
 
-/**	(prefix, cmd, params) = irc_input(line)
+/* Pushes the command uppercased; ASCII only, as commands are.
+	Returns the numeric if the command is 3 digits, otherwise -1.
+*/
+static int _pushCommand(lua_State *L, const char *s, size_t len)
+{
+	char buf[32];
+	size_t i;
+	if(len == 3 && s[0] >= '0' && s[0] <= '9' && s[1] >= '0' && s[1] <= '9'
+		&& s[2] >= '0' && s[2] <= '9')
+	{
+		lua_pushlstring(L, s, len);
+		return (s[0] - '0') * 100 + (s[1] - '0') * 10 + (s[2] - '0');
+	}
+	if(len <= sizeof(buf))
+	{
+		for(i = 0; i < len; i++)
+			buf[i] = (s[i] >= 'a' && s[i] <= 'z') ? s[i] - 'a' + 'A' : s[i];
+		lua_pushlstring(L, buf, len);
+	}
+	else
+	{
+		luaL_Buffer b;
+		luaL_buffinit(L, &b);
+		for(i = 0; i < len; i++)
+			luaL_addchar(&b, (s[i] >= 'a' && s[i] <= 'z') ? s[i] - 'a' + 'A' : s[i]);
+		luaL_pushresult(&b);
+	}
+	return -1;
+}
+
+
+/**	(prefix, cmd, params, tags, numeric) = irc_parse(line)
 	params is a table; prefix may be nil if no prefix.
+	cmd is uppercased; numeric is the integer code if cmd is a numeric, otherwise nil.
+	tags is the line's raw IRCv3 tags such as "batch=1;time=...", without the @,
+	or nil if none; values are left escaped, see irc_tag.
 */
 static int luafunc_irc_parse(lua_State *L)
 {
 	const char *s, *s2;
-	size_t i, x;
+	const char *tags = NULL;
+	size_t i, x, tagslen = 0;
+	int numeric = -1;
 	if(!lua_isstring(L, 1))
 		return 0; /* Number of return values. */
 	s = lua_tostring(L, 1);
 
+	/* tags: */
+	if(s[0] == '@')
+	{
+		tags = ++s;
+		s2 = strchr(s, ' ');
+		tagslen = s2 ? (size_t)(s2 - s) : strlen(s);
+		s += tagslen;
+		while(s[0] == ' ')
+			s++;
+	}
+
 	/* prefix: */
 	if(s[0] == ':')
 	{
@@ -1535,7 +1928,7 @@ static int luafunc_irc_parse(lua_State *L)
 	s2 = strchr(s, ' ');
 	if(s2)
 	{
-		lua_pushlstring(L, s, s2 - s);
+		numeric = _pushCommand(L, s, s2 - s);
 		s = s2 + 1;
 	}
 	else
@@ -1543,7 +1936,7 @@ static int luafunc_irc_parse(lua_State *L)
 		x = strlen(s);
 		if(x)
 		{
-			lua_pushlstring(L, s, x);
+			numeric = _pushCommand(L, s, x);
 			s += x;
 		}
 		else
@@ -1582,90 +1975,511 @@ static int luafunc_irc_parse(lua_State *L)
 		lua_settable(L, -1 -2);
 	}
 
-	return 3; /* Number of return values. */
+	if(tags)
+		lua_pushlstring(L, tags, tagslen);
+	else
+		lua_pushnil(L);
+	if(numeric >= 0)
+	{
+		lua_pushinteger(L, numeric);
+		return 5; /* Number of return values. */
+	}
+	return 4; /* Number of return values. */
 }
 
 
-static LL_INLINE int tolower_ascii(char ch)
+/* Pushes the tag value from v to tend, unescaped. */
+static void _pushTagValue(lua_State *L, const char *v, const char *tend)
 {
-	return ((ch) >= 'A' && (ch) <= 'Z') ?  ('a' + ((ch) - 'A')) : (ch);
+	luaL_Buffer b;
+	if(!memchr(v, '\\', tend - v))
+	{
+		lua_pushlstring(L, v, tend - v);
+		return;
+	}
+	luaL_buffinit(L, &b);
+	for(; v < tend; v++)
+	{
+		if(*v == '\\')
+		{
+			if(++v == tend)
+				break; /* A trailing \ is dropped. */
+			switch(*v)
+			{
+				case ':': luaL_addchar(&b, ';'); break;
+				case 's': luaL_addchar(&b, ' '); break;
+				case 'r': luaL_addchar(&b, '\r'); break;
+				case 'n': luaL_addchar(&b, '\n'); break;
+				default: luaL_addchar(&b, *v); /* \\ and unknown escapes. */
+			}
+		}
+		else
+		{
+			luaL_addchar(&b, *v);
+		}
+	}
+	luaL_pushresult(&b);
 }
 
-static LL_INLINE int tolower_rfc1459(char ch)
+
+/**	value = irc_tag(tags, key)
+	Finds the key in tags from irc_parse and returns its unescaped value,
+	"" if the tag has no value, or nil if the tag isn't there.
+*/
+static int luafunc_irc_tag(lua_State *L)
 {
-	/*  {}|~ are the lowercase of []\^  */
-	return ((ch) >= 'A' && (ch) <= '^') ?  ('a' + ((ch) - 'A')) : (ch);
+	size_t tagslen, keylen;
+	const char *tags, *key, *end, *t;
+	if(lua_isnoneornil(L, 1))
+		return 0; /* Number of return values. */
+	tags = luaL_checklstring(L, 1, &tagslen);
+	key = luaL_checklstring(L, 2, &keylen);
+	end = tags + tagslen;
+	for(t = tags; t < end; )
+	{
+		const char *tend = memchr(t, ';', end - t);
+		if(!tend)
+			tend = end;
+		if((size_t)(tend - t) >= keylen && !memcmp(t, key, keylen)
+			&& (t + keylen == tend || t[keylen] == '='))
+		{
+			const char *v = t + keylen;
+			if(v < tend)
+				v++; /* = */
+			_pushTagValue(L, v, tend);
+			return 1; /* Number of return values. */
+		}
+		t = tend + 1;
+	}
+	return 0; /* Number of return values. */
 }
 
-static LL_INLINE int tolower_strict_rfc1459(char ch)
+
+/*	Output buffer for irc_encode, grown as needed. */
+typedef struct
 {
-	/*  {}| are the lowercase of []\  */
-	return ((ch) >= 'A' && (ch) <= ']') ?  ('a' + ((ch) - 'A')) : (ch);
-}
+	char *data;
+	size_t len, cap;
+	int msgpack;
+	int failed;
+	char local[1024];
+}EncodeBuf;
 
 
-/**	*/
-static int compare_ascii(const char *s1, size_t s1len, const char *s2, size_t s2len)
+static void enc_put(EncodeBuf *e, const void *s, size_t n)
 {
-	size_t i;
-	for(i = 0;; i++)
-	{
-		if(i == s1len)
-		{
-			if(i == s2len)
-				break;
-			return -1;
-		}
-		else if(i == s2len)
+	if(e->len + n > e->cap)
+	{
+		size_t cap = e->cap * 2 + n;
+		char *data;
+		if(e->failed)
+			return;
+		data = (char*)malloc(cap);
+		if(!data)
 		{
-			return +1;
+			e->failed = 1; /* Checked when done. */
+			return;
 		}
-		if(tolower_ascii(s1[i]) != tolower_ascii(s2[i]))
-			return s1[i] - s2[i];
-	}
-	return 0;
+		memcpy(data, e->data, e->len);
+		if(e->data != e->local)
+			free(e->data);
+		e->data = data;
+		e->cap = cap;
+	}
+	memcpy(e->data + e->len, s, n);
+	e->len += n;
 }
 
-/**	*/
-static int compare_rfc1459(const char *s1, size_t s1len, const char *s2, size_t s2len)
+
+static void enc_byte(EncodeBuf *e, unsigned char c)
 {
-	size_t i;
-	for(i = 0;; i++)
+	enc_put(e, &c, 1);
+}
+
+
+/* MessagePack type byte followed by an unsigned big endian value of nbytes. */
+static void enc_big(EncodeBuf *e, unsigned char type, unsigned long v, int nbytes)
+{
+	unsigned char buf[5];
+	int i;
+	buf[0] = type;
+	for(i = 0; i < nbytes; i++)
+		buf[1 + i] = (unsigned char)(v >> (8 * (nbytes - 1 - i)));
+	enc_put(e, buf, 1 + nbytes);
+}
+
+
+static void enc_string(EncodeBuf *e, const char *s, size_t n)
+{
+	size_t i, start;
+	if(e->msgpack)
+	{
+		if(n < 32)
+			enc_byte(e, (unsigned char)(0xA0 | n));
+		else if(n < 0x100)
+			enc_big(e, 0xD9, (unsigned long)n, 1);
+		else if(n < 0x10000)
+			enc_big(e, 0xDA, (unsigned long)n, 2);
+		else
+			enc_big(e, 0xDB, (unsigned long)n, 4);
+		enc_put(e, s, n);
+		return;
+	}
+	enc_byte(e, '"');
+	for(start = i = 0; i < n; i++)
 	{
-		if(i == s1len)
-		{
-			if(i == s2len)
-				break;
-			return -1;
-		}
-		else if(i == s2len)
+		unsigned char c = (unsigned char)s[i];
+		if(c < 0x20 || c == '"' || c == '\\')
 		{
-			return +1;
+			char esc[8];
+			enc_put(e, s + start, i - start);
+			start = i + 1;
+			switch(c)
+			{
+				case '"': enc_put(e, "\\\"", 2); break;
+				case '\\': enc_put(e, "\\\\", 2); break;
+				case '\n': enc_put(e, "\\n", 2); break;
+				case '\r': enc_put(e, "\\r", 2); break;
+				case '\t': enc_put(e, "\\t", 2); break;
+				default:
+					sprintf(esc, "\\u%04x", c);
+					enc_put(e, esc, 6);
+			}
 		}
-		if(tolower_rfc1459(s1[i]) != tolower_rfc1459(s2[i]))
-			return s1[i] - s2[i];
 	}
-	return 0;
+	enc_put(e, s + start, n - start);
+	enc_byte(e, '"');
 }
 
-/**	*/
-static int compare_strict_rfc1459(const char *s1, size_t s1len, const char *s2, size_t s2len)
+
+static void enc_number(EncodeBuf *e, lua_Number v)
 {
-	size_t i;
-	for(i = 0;; i++)
+	if(e->msgpack)
 	{
-		if(i == s1len)
+		if(v >= 0 && v < 0x80 && v == (int)v)
 		{
-			if(i == s2len)
-				break;
-			return -1;
+			enc_byte(e, (unsigned char)v);
 		}
-		else if(i == s2len)
+		else if(v >= -2147483647.0 && v <= 2147483647.0 && v == (long)v)
 		{
-			return +1;
+			enc_big(e, 0xD2, (unsigned long)(long)v, 4);
+		}
+		else
+		{
+			union { double d; unsigned char b[8]; } u;
+			unsigned char buf[9];
+			int i, little = 1;
+			u.d = (double)v;
+			buf[0] = 0xCB;
+			for(i = 0; i < 8; i++)
+				buf[1 + i] = u.b[*(char*)&little ? 7 - i : i];
+			enc_put(e, buf, 9);
 		}
-		if(tolower_strict_rfc1459(s1[i]) != tolower_strict_rfc1459(s2[i]))
-			return s1[i] - s2[i];
+	}
+	else if(v != v || v - v != 0)
+	{
+		enc_put(e, "null", 4); /* JSON has no NaN or infinity. */
+	}
+	else
+	{
+		char num[64];
+		if(v >= -2147483647.0 && v <= 2147483647.0 && v == (long)v)
+			sprintf(num, "%ld", (long)v);
+		else
+			sprintf(num, "%.6f", (double)v);
+		enc_put(e, num, strlen(num));
+	}
+}
+
+
+static void enc_nil(EncodeBuf *e)
+{
+	if(e->msgpack)
+		enc_byte(e, 0xC0);
+	else
+		enc_put(e, "null", 4);
+}
+
+
+/* Starts a map or array of n items; JSON only needs the bracket. */
+static void enc_open(EncodeBuf *e, int isMap, size_t n)
+{
+	if(e->msgpack)
+	{
+		if(n < 16)
+			enc_byte(e, (unsigned char)((isMap ? 0x80 : 0x90) | n));
+		else if(n < 0x10000)
+			enc_big(e, isMap ? 0xDE : 0xDC, (unsigned long)n, 2);
+		else
+			enc_big(e, isMap ? 0xDF : 0xDD, (unsigned long)n, 4);
+	}
+	else
+	{
+		enc_byte(e, isMap ? '{' : '[');
+	}
+}
+
+
+static void enc_close(EncodeBuf *e, int isMap)
+{
+	if(!e->msgpack)
+		enc_byte(e, isMap ? '}' : ']');
+}
+
+
+/* Separates items in JSON, key is the map key or NULL in arrays. */
+static void enc_item(EncodeBuf *e, int first, const char *key, size_t keylen)
+{
+	if(!e->msgpack && !first)
+		enc_byte(e, ',');
+	if(key)
+	{
+		enc_string(e, key, keylen);
+		if(!e->msgpack)
+			enc_byte(e, ':');
+	}
+}
+
+
+/**	data = irc_encode(format, prefix, cmd, params [, tags [, time [, network]]])
+	Encodes an IRC message for programs reading the output, format is
+	"json" for a line of JSON, or "msgpack" for a 4 byte big endian length
+	followed by a MessagePack map. The map has the keys time, network, source,
+	nick, user, host (the parts of the source), command, numeric (for numerics),
+	params (an array) and tags (tag = value, unescaped); missing ones are left out.
+	tags is the raw tags from irc_parse.
+*/
+static int luafunc_irc_encode(lua_State *L)
+{
+	EncodeBuf e;
+	const char *format = luaL_checkstring(L, 1);
+	size_t prefixlen = 0, cmdlen, tagslen = 0, netlen = 0;
+	const char *prefix = lua_tolstring(L, 2, &prefixlen);
+	const char *cmd = luaL_checklstring(L, 3, &cmdlen);
+	const char *tags = lua_tolstring(L, 5, &tagslen);
+	const char *network = lua_tolstring(L, 7, &netlen);
+	const char *bang = NULL, *at = NULL;
+	int hasTime = lua_isnumber(L, 6);
+	int numeric = cmdlen == 3 && cmd[0] >= '0' && cmd[0] <= '9' && cmd[1] >= '0' && cmd[1] <= '9'
+		&& cmd[2] >= '0' && cmd[2] <= '9';
+	size_t nkeys, nparams, i;
+	luaL_checktype(L, 4, LUA_TTABLE);
+	e.data = e.local;
+	e.cap = sizeof(e.local);
+	e.len = 0;
+	e.failed = 0;
+	if(0 == strcmp(format, "msgpack"))
+		e.msgpack = 1;
+	else if(0 == strcmp(format, "json"))
+		e.msgpack = 0;
+	else
+		return luaL_argerror(L, 1, "format should be json or msgpack");
+	if(e.msgpack)
+		enc_put(&e, "\0\0\0\0", 4); /* Length, filled in when done. */
+
+	if(prefix)
+	{
+		bang = (const char*)memchr(prefix, '!', prefixlen);
+		at = (const char*)memchr(bang ? bang : prefix, '@', prefixlen - (bang ? bang - prefix : 0));
+	}
+	nkeys = 2 + (hasTime ? 1 : 0) + (network ? 1 : 0) + (prefix ? 2 : 0)
+		+ (bang ? 1 : 0) + (at ? 1 : 0) + (numeric ? 1 : 0) + (tags ? 1 : 0);
+	enc_open(&e, 1, nkeys);
+	i = 0;
+	if(hasTime)
+	{
+		enc_item(&e, !i++, "time", 4);
+		enc_number(&e, lua_tonumber(L, 6));
+	}
+	if(network)
+	{
+		enc_item(&e, !i++, "network", 7);
+		enc_string(&e, network, netlen);
+	}
+	if(prefix)
+	{
+		const char *nickend = bang ? bang : (at ? at : prefix + prefixlen);
+		enc_item(&e, !i++, "source", 6);
+		enc_string(&e, prefix, prefixlen);
+		enc_item(&e, !i++, "nick", 4);
+		enc_string(&e, prefix, nickend - prefix);
+		if(bang)
+		{
+			const char *userend = at ? at : prefix + prefixlen;
+			enc_item(&e, !i++, "user", 4);
+			enc_string(&e, bang + 1, userend - bang - 1);
+		}
+		if(at)
+		{
+			enc_item(&e, !i++, "host", 4);
+			enc_string(&e, at + 1, prefix + prefixlen - at - 1);
+		}
+	}
+	enc_item(&e, !i++, "command", 7);
+	enc_string(&e, cmd, cmdlen);
+	if(numeric)
+	{
+		enc_item(&e, !i++, "numeric", 7);
+		enc_number(&e, (cmd[0] - '0') * 100 + (cmd[1] - '0') * 10 + (cmd[2] - '0'));
+	}
+
+	enc_item(&e, !i++, "params", 6);
+	nparams = lua_objlen(L, 4);
+	enc_open(&e, 0, nparams);
+	for(i = 1; i <= nparams; i++)
+	{
+		enc_item(&e, i == 1, NULL, 0);
+		lua_rawgeti(L, 4, (int)i);
+		if(lua_type(L, -1) == LUA_TSTRING)
+		{
+			size_t len;
+			const char *s = lua_tolstring(L, -1, &len);
+			enc_string(&e, s, len);
+		}
+		else if(lua_type(L, -1) == LUA_TNUMBER)
+		{
+			enc_number(&e, lua_tonumber(L, -1));
+		}
+		else
+		{
+			enc_nil(&e);
+		}
+		lua_pop(L, 1);
+	}
+	enc_close(&e, 0);
+
+	if(tags)
+	{
+		const char *t, *end = tags + tagslen;
+		size_t ntags = 0;
+		for(t = tags; t < end; ntags++)
+		{
+			const char *tend = memchr(t, ';', end - t);
+			t = tend ? tend + 1 : end;
+		}
+		enc_item(&e, 0, "tags", 4);
+		enc_open(&e, 1, ntags);
+		for(i = 0, t = tags; t < end; i++)
+		{
+			const char *tend = memchr(t, ';', end - t);
+			const char *eq;
+			size_t vlen;
+			const char *v;
+			if(!tend)
+				tend = end;
+			eq = memchr(t, '=', tend - t);
+			enc_item(&e, !i, t, (eq ? eq : tend) - t);
+			_pushTagValue(L, eq ? eq + 1 : tend, tend);
+			v = lua_tolstring(L, -1, &vlen);
+			enc_string(&e, v, vlen);
+			lua_pop(L, 1);
+			t = tend + 1;
+		}
+		enc_close(&e, 1);
+	}
+	enc_close(&e, 1);
+
+	if(e.msgpack)
+	{
+		size_t body = e.len - 4;
+		e.data[0] = (char)(body >> 24);
+		e.data[1] = (char)(body >> 16);
+		e.data[2] = (char)(body >> 8);
+		e.data[3] = (char)body;
+	}
+	else
+	{
+		enc_byte(&e, '\n');
+	}
+	if(e.failed)
+		return luaL_error(L, "Out of memory encoding");
+	lua_pushlstring(L, e.data, e.len);
+	if(e.data != e.local)
+		free(e.data);
+	return 1; /* Number of return values. */
+}
+
+
+static LL_INLINE int tolower_ascii(char ch)
+{
+	return ((ch) >= 'A' && (ch) <= 'Z') ?  ('a' + ((ch) - 'A')) : (ch);
+}
+
+static LL_INLINE int tolower_rfc1459(char ch)
+{
+	/*  {}|~ are the lowercase of []\^  */
+	return ((ch) >= 'A' && (ch) <= '^') ?  ('a' + ((ch) - 'A')) : (ch);
+}
+
+static LL_INLINE int tolower_strict_rfc1459(char ch)
+{
+	/*  {}| are the lowercase of []\  */
+	return ((ch) >= 'A' && (ch) <= ']') ?  ('a' + ((ch) - 'A')) : (ch);
+}
+
+
+/**	*/
+static int compare_ascii(const char *s1, size_t s1len, const char *s2, size_t s2len)
+{
+	size_t i;
+	for(i = 0;; i++)
+	{
+		if(i == s1len)
+		{
+			if(i == s2len)
+				break;
+			return -1;
+		}
+		else if(i == s2len)
+		{
+			return +1;
+		}
+		if(tolower_ascii(s1[i]) != tolower_ascii(s2[i]))
+			return s1[i] - s2[i];
+	}
+	return 0;
+}
+
+/**	*/
+static int compare_rfc1459(const char *s1, size_t s1len, const char *s2, size_t s2len)
+{
+	size_t i;
+	for(i = 0;; i++)
+	{
+		if(i == s1len)
+		{
+			if(i == s2len)
+				break;
+			return -1;
+		}
+		else if(i == s2len)
+		{
+			return +1;
+		}
+		if(tolower_rfc1459(s1[i]) != tolower_rfc1459(s2[i]))
+			return s1[i] - s2[i];
+	}
+	return 0;
+}
+
+/**	*/
+static int compare_strict_rfc1459(const char *s1, size_t s1len, const char *s2, size_t s2len)
+{
+	size_t i;
+	for(i = 0;; i++)
+	{
+		if(i == s1len)
+		{
+			if(i == s2len)
+				break;
+			return -1;
+		}
+		else if(i == s2len)
+		{
+			return +1;
+		}
+		if(tolower_strict_rfc1459(s1[i]) != tolower_strict_rfc1459(s2[i]))
+			return s1[i] - s2[i];
 	}
 	return 0;
 }
@@ -1752,27 +2566,373 @@ LUAFUNC_TOLOWER(rfc1459)
 LUAFUNC_TOLOWER(strict_rfc1459)
 
 
+/**	(count, sources) = irc_names(nicklist, names, prefixSymbols, prefixModes [, tolower])
+	Parses the names of a NAMES (353) reply in one pass, such as "@+Joe Bob",
+	setting nicklist[tolower(nick)] to a table with nick and modes,
+	modes being the nick's prefix modes in PREFIX order, such as "ov" (multi-prefix).
+	Tables already in nicklist are updated, the nicklist's metatable is bypassed.
+	tolower is the client's tolower function, internal.tolower_rfc1459 by default.
+	sources is an array of the nick!user@host names (userhost-in-names), or nil if none.
+*/
+static int luafunc_irc_names(lua_State *L)
+{
+	const char *names, *syms, *modes, *nick, *end;
+	size_t nameslen, nsyms, nmodes, nicklen, i;
+	signed char rank[256];
+	int (*lower)(char) = tolower_rfc1459;
+	lua_CFunction tolowerfunc = NULL;
+	char buf[512];
+	char modebuf[32];
+	int count = 0, nsources = 0;
+
+	luaL_checktype(L, 1, LUA_TTABLE);
+	names = luaL_checklstring(L, 2, &nameslen);
+	syms = luaL_checklstring(L, 3, &nsyms);
+	modes = luaL_checklstring(L, 4, &nmodes);
+	if(nsyms != nmodes || nsyms > sizeof(modebuf))
+		return luaL_error(L, "irc_names: prefixSymbols and prefixModes don't match");
+	if(!lua_isnoneornil(L, 5))
+	{
+		luaL_checktype(L, 5, LUA_TFUNCTION);
+		tolowerfunc = lua_tocfunction(L, 5);
+		if(tolowerfunc == luafunc_tolower_ascii)
+			lower = tolower_ascii;
+		else if(tolowerfunc == luafunc_tolower_strict_rfc1459)
+			lower = tolower_strict_rfc1459;
+		else if(tolowerfunc == luafunc_tolower_rfc1459)
+			lower = tolower_rfc1459;
+		else
+			lower = NULL; /* Call it. */
+	}
+	lua_settop(L, 5);
+
+	memset(rank, -1, sizeof(rank));
+	for(i = 0; i < nsyms; i++)
+		rank[(unsigned char)syms[i]] = (signed char)i;
+
+	end = names + nameslen;
+	while(names < end)
+	{
+		unsigned long bits = 0;
+		size_t keylen, nmodebuf = 0;
+		const char *bang = NULL;
+
+		while(names < end && *names == ' ')
+			names++;
+		if(names == end)
+			break;
+		while(names < end && rank[(unsigned char)*names] >= 0)
+		{
+			bits |= 1UL << rank[(unsigned char)*names];
+			names++;
+		}
+		nick = names;
+		while(names < end && *names != ' ')
+		{
+			if(*names == '!' && !bang)
+				bang = names;
+			names++;
+		}
+		nicklen = names - nick;
+		if(!nicklen)
+			continue;
+		if(bang)
+		{
+			/* userhost-in-names */
+			if(!nsources)
+			{
+				lua_newtable(L); /* 6 */
+			}
+			lua_pushlstring(L, nick, nicklen);
+			lua_rawseti(L, 6, ++nsources);
+			nicklen = bang - nick;
+		}
+
+		/* key */
+		if(lower)
+		{
+			if(nicklen > sizeof(buf))
+				return luaL_error(L, "irc_names: nick exceeds length of buffer");
+			for(keylen = 0; keylen < nicklen; keylen++)
+				buf[keylen] = (char)lower(nick[keylen]);
+			lua_pushlstring(L, buf, nicklen);
+		}
+		else
+		{
+			lua_pushvalue(L, 5);
+			lua_pushlstring(L, nick, nicklen);
+			lua_call(L, 1, 1);
+		}
+
+		lua_pushvalue(L, -1);
+		lua_rawget(L, 1);
+		if(!lua_istable(L, -1))
+		{
+			lua_pop(L, 1);
+			lua_createtable(L, 0, 2);
+			lua_pushvalue(L, -2);
+			lua_pushvalue(L, -2);
+			lua_rawset(L, 1); /* nicklist[key] = entry */
+		}
+		lua_pushlstring(L, nick, nicklen);
+		lua_setfield(L, -2, "nick");
+		for(i = 0; i < nsyms; i++)
+		{
+			if(bits & (1UL << i))
+				modebuf[nmodebuf++] = modes[i];
+		}
+		lua_pushlstring(L, modebuf, nmodebuf);
+		lua_setfield(L, -2, "modes");
+		lua_pop(L, 2); /* entry, key */
+		count++;
+	}
+
+	lua_pushinteger(L, count);
+	if(nsources)
+		lua_pushvalue(L, 6);
+	else
+		lua_pushnil(L);
+	return 2; /* Number of return values. */
+}
+
+
+/* Lowercases the nick on the top of the stack with lower, or by calling the function at funcidx. */
+static void _lowerTop(lua_State *L, int (*lower)(char), int funcidx)
+{
+	size_t len, i;
+	const char *s = lua_tolstring(L, -1, &len);
+	if(lower)
+	{
+		char buf[512];
+		if(len > sizeof(buf))
+			luaL_error(L, "nick exceeds length of buffer");
+		for(i = 0; i < len; i++)
+			buf[i] = (char)lower(s[i]);
+		lua_pushlstring(L, buf, len);
+	}
+	else
+	{
+		lua_pushvalue(L, funcidx);
+		lua_pushvalue(L, -2);
+		lua_call(L, 1, 1);
+	}
+	lua_remove(L, -2);
+}
+
+/* Gets t[name] at index t, creating the table if needed; leaves it on the stack. */
+static void _subtable(lua_State *L, int t, const char *name)
+{
+	lua_getfield(L, t, name);
+	if(!lua_istable(L, -1))
+	{
+		lua_pop(L, 1);
+		lua_newtable(L);
+		lua_pushvalue(L, -1);
+		lua_setfield(L, t, name);
+	}
+}
+
+/**	count = irc_mode_apply(state, members, params, first, chanmodes, prefixModes [, tolower])
+	Applies the mode changes in params[first], such as "+ov-b", and the params after it,
+	to the channel's state and members; returns the number of changes applied.
+	state.modes[m] is true or the parameter of set simple modes (CHANMODES types B, C, D),
+	state.lists[m][mask] is true for list modes (type A) entries such as bans.
+	members is the channel's nicklist, see irc_names; the modes field of
+	members[tolower(nick)] is updated for prefix modes, keeping PREFIX order.
+	chanmodes is the CHANMODES value, such as "beI,k,l,imnpst"; unknown modes take no parameter.
+	members and tolower can be nil.
+*/
+static int luafunc_irc_mode_apply(lua_State *L)
+{
+	const char *chanmodes, *pmodes, *ms;
+	size_t npmodes, mslen, i;
+	char mtype[256];
+	int (*lower)(char) = tolower_rfc1459;
+	int first, nparams, iparam, count = 0, adding = 1;
+	int t;
+
+	luaL_checktype(L, 1, LUA_TTABLE);
+	luaL_checktype(L, 3, LUA_TTABLE);
+	first = luaL_checkint(L, 4);
+	chanmodes = luaL_optstring(L, 5, "beI,k,l,imnpst");
+	pmodes = luaL_optlstring(L, 6, "ov", &npmodes);
+	if(npmodes > 32)
+		return luaL_error(L, "irc_mode_apply: too many prefix modes");
+	if(!lua_isnoneornil(L, 7))
+	{
+		lua_CFunction tolowerfunc;
+		luaL_checktype(L, 7, LUA_TFUNCTION);
+		tolowerfunc = lua_tocfunction(L, 7);
+		if(tolowerfunc == luafunc_tolower_ascii)
+			lower = tolower_ascii;
+		else if(tolowerfunc == luafunc_tolower_strict_rfc1459)
+			lower = tolower_strict_rfc1459;
+		else if(tolowerfunc != luafunc_tolower_rfc1459)
+			lower = NULL; /* Call it. */
+	}
+	lua_settop(L, 7);
+
+	/* Mode types: 'A' to 'D' from CHANMODES, 'P' for prefix modes, 0 unknown. */
+	memset(mtype, 0, sizeof(mtype));
+	for(t = 'A'; *chanmodes; chanmodes++)
+	{
+		if(*chanmodes == ',')
+			t++;
+		else if(t <= 'D')
+			mtype[(unsigned char)*chanmodes] = (char)t;
+	}
+	for(i = 0; i < npmodes; i++)
+		mtype[(unsigned char)pmodes[i]] = 'P';
+
+	lua_rawgeti(L, 3, first);
+	ms = lua_tolstring(L, -1, &mslen);
+	if(!ms)
+		return luaL_error(L, "irc_mode_apply: no mode string");
+	lua_pop(L, 1); /* Still referenced from params. */
+	nparams = (int)lua_objlen(L, 3);
+	iparam = first + 1;
+
+	_subtable(L, 1, "modes"); /* 8 */
+	_subtable(L, 1, "lists"); /* 9 */
+
+	for(i = 0; i < mslen; i++)
+	{
+		unsigned char m = (unsigned char)ms[i];
+		char mstr[2];
+		int needparam;
+		if(m == '+' || m == '-')
+		{
+			adding = m == '+';
+			continue;
+		}
+		mstr[0] = (char)m;
+		mstr[1] = 0;
+		switch(mtype[m])
+		{
+			case 'A': case 'B': case 'P': needparam = 1; break;
+			case 'C': needparam = adding; break;
+			default: needparam = 0;
+		}
+		if(needparam)
+		{
+			if(iparam > nparams)
+				break; /* Malformed, missing parameter. */
+			lua_rawgeti(L, 3, iparam++); /* 10 */
+		}
+		switch(mtype[m])
+		{
+			case 'A':
+				_subtable(L, 9, mstr);
+				lua_pushvalue(L, 10);
+				if(adding)
+					lua_pushboolean(L, 1);
+				else
+					lua_pushnil(L);
+				lua_rawset(L, -3);
+				lua_pop(L, 1);
+				break;
+
+			case 'P':
+				if(lua_istable(L, 2))
+				{
+					const char *cur;
+					size_t curlen, j, k;
+					char newmodes[32];
+					unsigned long bits = 0;
+					lua_pushvalue(L, 10);
+					_lowerTop(L, lower, 7);
+					lua_rawget(L, 2);
+					if(lua_istable(L, -1))
+					{
+						lua_getfield(L, -1, "modes");
+						cur = lua_tolstring(L, -1, &curlen);
+						for(j = 0; cur && j < curlen; j++)
+						{
+							for(k = 0; k < npmodes; k++)
+							{
+								if(pmodes[k] == cur[j])
+									bits |= 1UL << k;
+							}
+						}
+						lua_pop(L, 1);
+						for(k = 0; k < npmodes; k++)
+						{
+							if(pmodes[k] == (char)m)
+							{
+								if(adding)
+									bits |= 1UL << k;
+								else
+									bits &= ~(1UL << k);
+							}
+						}
+						for(j = 0, k = 0; k < npmodes; k++)
+						{
+							if(bits & (1UL << k))
+								newmodes[j++] = pmodes[k];
+						}
+						lua_pushlstring(L, newmodes, j);
+						lua_setfield(L, -2, "modes");
+					}
+					lua_pop(L, 1);
+				}
+				break;
+
+			default:
+				if(adding)
+				{
+					if(needparam)
+						lua_pushvalue(L, 10);
+					else
+						lua_pushboolean(L, 1);
+				}
+				else
+				{
+					lua_pushnil(L);
+				}
+				lua_setfield(L, 8, mstr);
+		}
+		if(needparam)
+			lua_pop(L, 1);
+		count++;
+	}
+
+	lua_pushinteger(L, count);
+	return 1; /* Number of return values. */
+}
+
+
+/* Shared by the worker threads' states. */
+#ifdef _ON_WINDOWS_
+/* No worker threads on Windows. */
+#define _memLoad(p) (*(p))
+#define _memStore(p, v) (*(p) = (v))
+#define _memAdd(p, n) (*(p) += (n))
+#else
+#define _memLoad(p) __atomic_load_n((p), __ATOMIC_RELAXED)
+#define _memStore(p, v) __atomic_store_n((p), (v), __ATOMIC_RELAXED)
+#define _memAdd(p, n) __atomic_add_fetch((p), (n), __ATOMIC_RELAXED)
+#endif
 lua_Alloc realLuaAllocFunc = NULL;
 ptrdiff_t memLimit = 0;
 ptrdiff_t memAllocCounter = 0;
 
 static void *memLimitLuaAlloc(void *ud, void *ptr, size_t oldSize, size_t newSize)
 {
-	if(memLimit)
+	ptrdiff_t limit = _memLoad(&memLimit);
+	if(limit)
 	{
 		/* Using sign because this can legit end up negative (old memory realloc smaller). */
-		memAllocCounter -= oldSize;
-		memAllocCounter += newSize;
+		ptrdiff_t counter = _memAdd(&memAllocCounter, (ptrdiff_t)newSize - (ptrdiff_t)oldSize);
 		if(newSize > oldSize)
 		{
-			if(memAllocCounter > memLimit)
+			if(counter > limit)
 			{
-				memLimit = 0;
+				_memStore(&memLimit, 0);
 				return NULL;
 			}
 		}
 	}
-	return realLuaAllocFunc(ud, ptr, oldSize, newSize);
+	return _memLoad(&realLuaAllocFunc)(ud, ptr, oldSize, newSize);
 }
 
 
@@ -1782,7 +2942,8 @@ static void *memLimitLuaAlloc(void *ud, void *ptr, size_t oldSize, size_t newSiz
 	If limit is omitted, just returns the current limit and counter.
 	If a limit is set (limit>0) then the counter is reset to 0.
 	counter is how many bytes have been allocated.
-	Note: only works with one lua state, unless called with the same value on all states.
+	Note: the limit and counter are for all lua states together, including workers';
+	only the states it is called on (or with) are counted.
 	When the limit is tripped, the lua allocator returns NULL and then the limit is removed.
 	Note: consider emergency GC in lua 5.2.
 	For strictness and/or accurate accounting, do a GC collection before setting the limit.
@@ -1797,21 +2958,22 @@ static int luafunc_memory_limit(lua_State *L)
 		lua_Integer lim = lua_tointeger(L, 1);
 		if(0 == lim)
 		{
-			memLimit = 0;
+			_memStore(&memLimit, 0);
 		}
 		else if(lim > 0)
 		{
 			void *ud;
 			if(&memLimitLuaAlloc != lua_getallocf(L, &ud))
 			{
-				if(!realLuaAllocFunc)
+				if(!_memLoad(&realLuaAllocFunc))
 				{
-					realLuaAllocFunc = lua_getallocf(L, &ud);
-					if(!realLuaAllocFunc)
+					lua_Alloc real = lua_getallocf(L, &ud);
+					if(!real)
 					{
 						_programError("luafunc_memory_limit: lua_getallocf returned NULL", 0);
 						return 0;
 					}
+					_memStore(&realLuaAllocFunc, real); /* Every state has the same allocator. */
 				}
 				lua_setallocf(L, &memLimitLuaAlloc, ud);
 				if(&memLimitLuaAlloc != lua_getallocf(L, NULL))
@@ -1824,7 +2986,7 @@ static int luafunc_memory_limit(lua_State *L)
 			{
 				if(&memLimitLuaAlloc != lua_getallocf(lthread, &ud))
 				{
-					if(!realLuaAllocFunc)
+					if(!_memLoad(&realLuaAllocFunc))
 					{
 						_programError("luafunc_memory_limit: internal error, realLuaAllocFunc expected to be set", 0);
 						return 0;
@@ -1837,16 +2999,567 @@ static int luafunc_memory_limit(lua_State *L)
 					}
 				}
 			}
-			memLimit = lim;
-			memAllocCounter = 0;
+			_memStore(&memAllocCounter, 0);
+			_memStore(&memLimit, (ptrdiff_t)lim);
 		}
 	}
-	lua_pushinteger(L, memLimit);
-	lua_pushinteger(L, memAllocCounter);
+	lua_pushinteger(L, _memLoad(&memLimit));
+	lua_pushinteger(L, _memLoad(&memAllocCounter));
 	return 2; /* Number of return values. */
 }
 
 
+#ifndef _ON_WINDOWS_
+
+#include <dlfcn.h>
+
+/* From the patched lcoco.c in src/lua-5.1, looked up since the lua we're loaded into may not have them. */
+typedef int (*coco_poolsize_func)(int poolmax);
+typedef void (*coco_stackstats_func)(int *live, int *pooled, int *peak);
+
+/**	(live, pooled, peak, poolmax) = coco_stacks([poolmax])
+	Returns the coroutine C stacks in use, kept in the pool for reuse,
+	the most in use at once, and how many the pool keeps.
+	If poolmax is set, the pool keeps at most that many freed stacks from now on.
+	Returns nil if lua doesn't have the stack pool.
+	The size of new stacks is set with coroutine.cstacksize.
+*/
+static int luafunc_coco_stacks(lua_State *L)
+{
+	static int looked = 0;
+	static coco_poolsize_func poolsize = NULL;
+	static coco_stackstats_func stackstats = NULL;
+	int live, pooled, peak, poolmax;
+	if(!looked)
+	{
+		void *self = dlopen(NULL, RTLD_LAZY);
+		if(self)
+		{
+			poolsize = (coco_poolsize_func)dlsym(self, "luaCOCO_poolsize");
+			stackstats = (coco_stackstats_func)dlsym(self, "luaCOCO_stackstats");
+			dlclose(self);
+		}
+		looked = 1;
+	}
+	if(!poolsize || !stackstats)
+	{
+		lua_pushnil(L);
+		return 1;
+	}
+	poolmax = (int)luaL_optinteger(L, 1, -1);
+	if(poolmax < 0)
+	{
+		poolmax = poolsize(-1);
+	}
+	else
+	{
+		poolsize(poolmax);
+	}
+	stackstats(&live, &pooled, &peak);
+	lua_pushinteger(L, live);
+	lua_pushinteger(L, pooled);
+	lua_pushinteger(L, peak);
+	lua_pushinteger(L, poolmax);
+	return 4;
+}
+
+#define HAS_coco_stacks
+
+#endif
+
+
+/*	Log-linear histogram in the style of HdrHistogram:
+	values below HIST_SUB_COUNT get their own bucket, after that every power of two
+	is split into HIST_SUB_COUNT/2 buckets, so any value is off by at most ~6%.
+*/
+#define HIST_SUB_BITS 5
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+#define HIST_SUB_HALF (HIST_SUB_COUNT / 2)
+#define HIST_NUM_BUCKETS (HIST_SUB_COUNT + (32 - HIST_SUB_BITS) * HIST_SUB_HALF)
+#define HISTOGRAM_MT "irccmd.histogram"
+
+typedef struct
+{
+	unsigned long counts[HIST_NUM_BUCKETS];
+	unsigned long total;
+	unsigned long min, max;
+	double sum;
+}Histogram;
+
+
+static int hist_bucket(unsigned long v)
+{
+	int shift = 0;
+	if(v > 0xFFFFFFFFUL)
+		v = 0xFFFFFFFFUL;
+	if(v < HIST_SUB_COUNT)
+		return (int)v;
+	while((v >> shift) >= HIST_SUB_COUNT)
+		shift++;
+	/* Now (v >> shift) is in [HIST_SUB_HALF, HIST_SUB_COUNT). */
+	return HIST_SUB_COUNT + (shift - 1) * HIST_SUB_HALF + (int)((v >> shift) - HIST_SUB_HALF);
+}
+
+
+/**	Highest value that lands in the bucket. */
+static unsigned long hist_bucket_high(int b)
+{
+	int shift;
+	unsigned long sub;
+	if(b < HIST_SUB_COUNT)
+		return (unsigned long)b;
+	shift = (b - HIST_SUB_COUNT) / HIST_SUB_HALF + 1;
+	sub = (b - HIST_SUB_COUNT) % HIST_SUB_HALF + HIST_SUB_HALF;
+	return ((sub + 1) << shift) - 1;
+}
+
+
+static unsigned long hist_percentile(const Histogram *h, double p)
+{
+	unsigned long want, seen = 0;
+	int b;
+	if(!h->total)
+		return 0;
+	if(p < 0)
+		p = 0;
+	if(p > 100)
+		p = 100;
+	want = (unsigned long)(p / 100.0 * h->total + 0.5);
+	if(want < 1)
+		want = 1;
+	for(b = 0; b < HIST_NUM_BUCKETS; b++)
+	{
+		seen += h->counts[b];
+		if(seen >= want)
+		{
+			unsigned long high = hist_bucket_high(b);
+			return high > h->max ? h->max : high;
+		}
+	}
+	return h->max;
+}
+
+
+#if _DEBUG
+static void histogram_Test()
+{
+	unsigned long v;
+	for(v = 0; v < 100000; v += 7)
+	{
+		int b = hist_bucket(v);
+		assert(b >= 0 && b < HIST_NUM_BUCKETS);
+		assert(v <= hist_bucket_high(b));
+		assert(0 == b || v > hist_bucket_high(b - 1));
+	}
+	assert(HIST_NUM_BUCKETS - 1 == hist_bucket(0xFFFFFFFFUL));
+}
+#endif
+
+
+/**	h = histogram()
+	Returns a new empty histogram of non-negative integers, such as milliseconds.
+	h:record(value [, count])
+	h:percentile(p) where p is 0 to 100.
+	h:count(), h:min(), h:max(), h:mean()
+	h:stats() returns a table with count, min, max, mean, p50, p90, p99.
+	h:reset()
+*/
+static int luafunc_histogram(lua_State *L)
+{
+	Histogram *h = (Histogram*)lua_newuserdata(L, sizeof(Histogram));
+	memset(h, 0, sizeof(Histogram));
+	luaL_getmetatable(L, HISTOGRAM_MT);
+	lua_setmetatable(L, -2);
+	return 1; /* Number of return values. */
+}
+
+
+static int luafunc_histogram_record(lua_State *L)
+{
+	Histogram *h = (Histogram*)luaL_checkudata(L, 1, HISTOGRAM_MT);
+	lua_Number n = luaL_checknumber(L, 2);
+	unsigned long count = (unsigned long)luaL_optinteger(L, 3, 1);
+	unsigned long v = n > 0 ? (unsigned long)n : 0;
+	h->counts[hist_bucket(v)] += count;
+	if(!h->total || v < h->min)
+		h->min = v;
+	if(v > h->max)
+		h->max = v;
+	h->total += count;
+	h->sum += (double)v * count;
+	return 0; /* Number of return values. */
+}
+
+
+static int luafunc_histogram_percentile(lua_State *L)
+{
+	Histogram *h = (Histogram*)luaL_checkudata(L, 1, HISTOGRAM_MT);
+	lua_pushnumber(L, hist_percentile(h, luaL_checknumber(L, 2)));
+	return 1; /* Number of return values. */
+}
+
+
+static int luafunc_histogram_count(lua_State *L)
+{
+	Histogram *h = (Histogram*)luaL_checkudata(L, 1, HISTOGRAM_MT);
+	lua_pushnumber(L, h->total);
+	return 1; /* Number of return values. */
+}
+
+
+static int luafunc_histogram_min(lua_State *L)
+{
+	Histogram *h = (Histogram*)luaL_checkudata(L, 1, HISTOGRAM_MT);
+	lua_pushnumber(L, h->min);
+	return 1; /* Number of return values. */
+}
+
+
+static int luafunc_histogram_max(lua_State *L)
+{
+	Histogram *h = (Histogram*)luaL_checkudata(L, 1, HISTOGRAM_MT);
+	lua_pushnumber(L, h->max);
+	return 1; /* Number of return values. */
+}
+
+
+static int luafunc_histogram_mean(lua_State *L)
+{
+	Histogram *h = (Histogram*)luaL_checkudata(L, 1, HISTOGRAM_MT);
+	lua_pushnumber(L, h->total ? h->sum / h->total : 0);
+	return 1; /* Number of return values. */
+}
+
+
+static int luafunc_histogram_stats(lua_State *L)
+{
+	Histogram *h = (Histogram*)luaL_checkudata(L, 1, HISTOGRAM_MT);
+	lua_createtable(L, 0, 7);
+	lua_pushnumber(L, h->total);
+	lua_setfield(L, -2, "count");
+	lua_pushnumber(L, h->min);
+	lua_setfield(L, -2, "min");
+	lua_pushnumber(L, h->max);
+	lua_setfield(L, -2, "max");
+	lua_pushnumber(L, h->total ? h->sum / h->total : 0);
+	lua_setfield(L, -2, "mean");
+	lua_pushnumber(L, hist_percentile(h, 50));
+	lua_setfield(L, -2, "p50");
+	lua_pushnumber(L, hist_percentile(h, 90));
+	lua_setfield(L, -2, "p90");
+	lua_pushnumber(L, hist_percentile(h, 99));
+	lua_setfield(L, -2, "p99");
+	return 1; /* Number of return values. */
+}
+
+
+static int luafunc_histogram_reset(lua_State *L)
+{
+	Histogram *h = (Histogram*)luaL_checkudata(L, 1, HISTOGRAM_MT);
+	memset(h, 0, sizeof(Histogram));
+	return 0; /* Number of return values. */
+}
+
+
+static void register_histogram(lua_State *L)
+{
+	static const luaL_Reg methods[] = {
+		{ "record", &luafunc_histogram_record },
+		{ "percentile", &luafunc_histogram_percentile },
+		{ "count", &luafunc_histogram_count },
+		{ "min", &luafunc_histogram_min },
+		{ "max", &luafunc_histogram_max },
+		{ "mean", &luafunc_histogram_mean },
+		{ "stats", &luafunc_histogram_stats },
+		{ "reset", &luafunc_histogram_reset },
+		{ NULL, NULL }
+	};
+	luaL_newmetatable(L, HISTOGRAM_MT);
+	lua_newtable(L);
+	luaL_register(L, NULL, methods);
+	lua_setfield(L, -2, "__index");
+	lua_pop(L, 1);
+}
+
+
+/*	Compiled templates for comm_input and comm_output, such as "{target} <{nick}> {msg}".
+	Each op is a literal or a {name} slot; the strings are kept in the userdata's
+	environment table, so rendering only indexes tables and appends to one buffer.
+*/
+#define TEMPLATE_MT "irccmd.template"
+
+enum
+{
+	TOP_LITERAL, /* env[ref] is the text. */
+	TOP_SLOT, /* env[ref] is the name, env[ref + 1] the text shown if no value. */
+	TOP_NICK, /* nick, or the nick of the source. */
+	TOP_CHAN, /* channel, chan, or the channel of the target. */
+	TOP_MSG, /* msg or message. */
+};
+
+typedef struct
+{
+	unsigned char kind;
+	unsigned char dots; /* {name...} shows nothing if no value, and takes the rest of the params. */
+	int ref;
+}TemplateOp;
+
+typedef struct
+{
+	int nops;
+	TemplateOp ops[1];
+}Template;
+
+
+/**	t = template(syntax)
+	Compiles syntax, where {name} is replaced by values.name when rendered.
+	t:render(values [, client]) returns the text; {nick}, {chan} and {msg}
+	fall back like IrcClient:translate2, client is used for the channel of {target}.
+	t:values(params [, values]) sets values by position from params, such as
+	for IrcClient.readServerCommands; returns values.
+	t:slots() returns an array of the names as written, such as "2+" or "msg...".
+*/
+static int luafunc_template(lua_State *L)
+{
+	size_t len, i, start, nameend;
+	const char *s = luaL_checklstring(L, 1, &len);
+	int nops = 0, nrefs = 0;
+	Template *t;
+	/* Each { may start a slot, with a literal before it; and one literal at the end. */
+	for(i = 0; i < len; i++)
+	{
+		if(s[i] == '{')
+			nops += 2;
+	}
+	nops++;
+	t = (Template*)lua_newuserdata(L, sizeof(Template) + sizeof(TemplateOp) * nops);
+	t->nops = 0;
+	luaL_getmetatable(L, TEMPLATE_MT);
+	lua_setmetatable(L, -2);
+	lua_newtable(L); /* env */
+	for(start = i = 0; i <= len; i++)
+	{
+		const char *close = NULL;
+		if(i < len && s[i] == '{')
+			close = (const char*)memchr(s + i + 1, '}', len - i - 1);
+		if(i == len || close)
+		{
+			if(i > start)
+			{
+				TemplateOp *op = &t->ops[t->nops++];
+				op->kind = TOP_LITERAL;
+				op->dots = 0;
+				op->ref = ++nrefs;
+				lua_pushlstring(L, s + start, i - start);
+				lua_rawseti(L, -2, op->ref);
+			}
+			if(close)
+			{
+				TemplateOp *op = &t->ops[t->nops++];
+				const char *name = s + i + 1;
+				nameend = close - name;
+				op->dots = nameend >= 3 && 0 == memcmp(close - 3, "...", 3);
+				if(op->dots)
+					nameend -= 3;
+				op->kind = TOP_SLOT;
+				if(nameend == 4 && 0 == memcmp(name, "nick", 4))
+					op->kind = TOP_NICK;
+				else if((nameend == 4 && 0 == memcmp(name, "chan", 4))
+					|| (nameend == 7 && 0 == memcmp(name, "channel", 7)))
+					op->kind = TOP_CHAN;
+				else if((nameend == 3 && 0 == memcmp(name, "msg", 3))
+					|| (nameend == 7 && 0 == memcmp(name, "message", 7)))
+					op->kind = TOP_MSG;
+				op->ref = ++nrefs;
+				lua_pushlstring(L, name, nameend);
+				lua_rawseti(L, -2, op->ref);
+				nrefs++;
+				lua_pushlstring(L, s + i, close - s + 1 - i); /* {name} as written. */
+				lua_rawseti(L, -2, op->ref + 1);
+				i = close - s;
+				start = i + 1;
+			}
+		}
+	}
+	lua_setfenv(L, -2);
+	return 1; /* Number of return values. */
+}
+
+
+/* Pushes values[key] if it's set and not false, returns whether pushed. */
+static int _templateValue(lua_State *L, int ivalues, const char *key)
+{
+	lua_getfield(L, ivalues, key);
+	if(lua_toboolean(L, -1))
+		return 1;
+	lua_pop(L, 1);
+	return 0;
+}
+
+
+static int luafunc_template_render(lua_State *L)
+{
+	Template *t = (Template*)luaL_checkudata(L, 1, TEMPLATE_MT);
+	luaL_Buffer b;
+	int i, ienv, found;
+	luaL_checktype(L, 2, LUA_TTABLE);
+	lua_settop(L, 3); /* client or nil */
+	lua_getfenv(L, 1);
+	ienv = lua_gettop(L);
+	luaL_buffinit(L, &b);
+	for(i = 0; i < t->nops; i++)
+	{
+		const TemplateOp *op = &t->ops[i];
+		/* Values are pushed above the buffer, which luaL_addvalue expects. */
+		if(op->kind == TOP_LITERAL)
+		{
+			lua_rawgeti(L, ienv, op->ref);
+			luaL_addvalue(&b);
+			continue;
+		}
+		found = 0;
+		if(op->kind == TOP_NICK)
+		{
+			found = _templateValue(L, 2, "nick");
+			if(!found && _templateValue(L, 2, "source"))
+			{
+				size_t srclen;
+				const char *src = luaL_checklstring(L, -1, &srclen);
+				const char *bang = (const char*)memchr(src, '!', srclen);
+				if(bang)
+				{
+					lua_pushlstring(L, src, bang - src);
+					lua_remove(L, -2);
+				}
+				found = 1;
+			}
+		}
+		else if(op->kind == TOP_CHAN)
+		{
+			found = _templateValue(L, 2, "channel") || _templateValue(L, 2, "chan");
+			if(!found && !lua_isnoneornil(L, 3) && _templateValue(L, 2, "target"))
+			{
+				lua_getfield(L, 3, "channelNameFromTarget");
+				lua_insert(L, -2);
+				lua_pushvalue(L, 3);
+				lua_insert(L, -2);
+				lua_call(L, 2, 1);
+				found = lua_toboolean(L, -1);
+				if(!found)
+					lua_pop(L, 1);
+			}
+		}
+		else if(op->kind == TOP_MSG)
+		{
+			found = _templateValue(L, 2, "msg") || _templateValue(L, 2, "message");
+		}
+		else
+		{
+			lua_rawgeti(L, ienv, op->ref);
+			lua_gettable(L, 2);
+			found = lua_toboolean(L, -1);
+			if(!found)
+				lua_pop(L, 1);
+		}
+		if(found)
+		{
+			if(!lua_isstring(L, -1))
+				return luaL_error(L, "invalid template value (a %s)", luaL_typename(L, -1));
+			luaL_addvalue(&b);
+		}
+		else if(!op->dots)
+		{
+			lua_rawgeti(L, ienv, op->ref + 1);
+			luaL_addvalue(&b);
+		}
+	}
+	luaL_pushresult(&b);
+	return 1; /* Number of return values. */
+}
+
+
+static int luafunc_template_values(lua_State *L)
+{
+	Template *t = (Template*)luaL_checkudata(L, 1, TEMPLATE_MT);
+	int i, iparam = 1, nparams;
+	luaL_checktype(L, 2, LUA_TTABLE);
+	nparams = (int)lua_objlen(L, 2);
+	if(lua_isnoneornil(L, 3))
+	{
+		lua_settop(L, 2);
+		lua_newtable(L);
+	}
+	luaL_checktype(L, 3, LUA_TTABLE);
+	lua_getfenv(L, 1);
+	for(i = 0; i < t->nops; i++)
+	{
+		const TemplateOp *op = &t->ops[i];
+		if(op->kind == TOP_LITERAL)
+			continue;
+		lua_rawgeti(L, 4, op->ref); /* name */
+		if(op->dots && iparam < nparams)
+		{
+			luaL_Buffer b;
+			luaL_buffinit(L, &b);
+			for(; iparam <= nparams; iparam++)
+			{
+				lua_rawgeti(L, 2, iparam);
+				luaL_addvalue(&b);
+				if(iparam < nparams)
+					luaL_addchar(&b, ' ');
+			}
+			luaL_pushresult(&b);
+		}
+		else
+		{
+			lua_rawgeti(L, 2, iparam++);
+		}
+		lua_settable(L, 3);
+	}
+	lua_pushvalue(L, 3);
+	return 1; /* Number of return values. */
+}
+
+
+static int luafunc_template_slots(lua_State *L)
+{
+	Template *t = (Template*)luaL_checkudata(L, 1, TEMPLATE_MT);
+	int i, n = 0;
+	size_t len;
+	lua_getfenv(L, 1);
+	lua_newtable(L);
+	for(i = 0; i < t->nops; i++)
+	{
+		if(t->ops[i].kind != TOP_LITERAL)
+		{
+			const char *raw;
+			lua_rawgeti(L, -2, t->ops[i].ref + 1);
+			raw = lua_tolstring(L, -1, &len);
+			lua_pushlstring(L, raw + 1, len - 2); /* Without the braces. */
+			lua_rawseti(L, -3, ++n);
+			lua_pop(L, 1);
+		}
+	}
+	return 1; /* Number of return values. */
+}
+
+
+static void register_template(lua_State *L)
+{
+	static const luaL_Reg methods[] = {
+		{ "render", &luafunc_template_render },
+		{ "values", &luafunc_template_values },
+		{ "slots", &luafunc_template_slots },
+		{ NULL, NULL }
+	};
+	luaL_newmetatable(L, TEMPLATE_MT);
+	lua_newtable(L);
+	luaL_register(L, NULL, methods);
+	lua_setfield(L, -2, "__index");
+	lua_pop(L, 1);
+}
+
+
 #ifdef HAS_UTF32toUTF8char
 /**	string = UTF32toUTF8char(utf32number, ...)
 	All the UTF32 codepoint numbers passed in compose the result string.
@@ -1921,20 +3634,40 @@ int luaopen_irccmd_internal(lua_State *L)
 {
 #if _DEBUG
 	compare_Test();
+	histogram_Test();
 	fprintf(stderr, "Tests completed\n");
 #endif
 
-	frandom_init(&frand, rrandom());
+	if(!frand._rh)
+		frandom_init(&frand, rrandom()); /* Once, workers load this too. */
+	_stateFRandom(L);
+
+	register_histogram(L);
+	register_template(L);
 
 	luaL_Reg array[] = {
 		{ "random", &luafunc_random },
 		{ "frandom", &luafunc_frandom },
 		{ "milliseconds", &luafunc_milliseconds },
 		{ "milliseconds_diff", &luafunc_milliseconds_diff },
+		{ "timestamp", &luafunc_timestamp },
 		{ "console_print", &luafunc_console_print },
 		{ "console_print_err", &luafunc_console_print_err },
+#ifdef HAS_OUTBUF
+		{ "console_buffer", &luafunc_console_buffer },
+		{ "console_flush", &luafunc_console_flush },
+#endif
+#ifdef HAS_IRCRING
+		{ "ring_open", &luafunc_ring_open },
+		{ "ring_write", &luafunc_ring_write },
+		{ "ring_close", &luafunc_ring_close },
+#endif
 		{ "irc_input", &luafunc_irc_input },
 		{ "irc_parse", &luafunc_irc_parse },
+		{ "irc_tag", &luafunc_irc_tag },
+		{ "irc_encode", &luafunc_irc_encode },
+		{ "irc_names", &luafunc_irc_names },
+		{ "irc_mode_apply", &luafunc_irc_mode_apply },
 		{ "compare_ascii", &luafunc_compare_ascii },
 		{ "compare_rfc1459", &luafunc_compare_rfc1459 },
 		{ "compare_strict_rfc1459", &luafunc_compare_rfc1459 },
@@ -1948,14 +3681,30 @@ int luaopen_irccmd_internal(lua_State *L)
 		{ "socket_close", &luafunc_socket_close },
 		{ "socket_blocking", &luafunc_socket_blocking },
 		{ "socket_linger", &luafunc_socket_linger },
+		{ "socket_keepalive", &luafunc_socket_keepalive },
 		/* { "socket_reuseaddr", &luafunc_socket_reuseaddr }, */
 		{ "socket_shutdown", &luafunc_socket_shutdown },
 		{ "socket_send", &luafunc_socket_send },
 		{ "socket_receive", &luafunc_socket_receive },
 		{ "socket_select", &luafunc_socket_select },
 		{ "memory_limit", &luafunc_memory_limit },
+		{ "histogram", &luafunc_histogram },
+		{ "template", &luafunc_template },
+#ifdef HAS_coco_stacks
+		{ "coco_stacks", &luafunc_coco_stacks },
+#endif
 #ifdef HAS_UTF32toUTF8char
 		{ "UTF32toUTF8char", &luafunc_UTF32toUTF8char },
+#endif
+#ifdef HAS_WORKERS
+		{ "worker_start", &luafunc_worker_start },
+		{ "worker_join", &luafunc_worker_join },
+		{ "worker_mailbox", &luafunc_worker_mailbox },
+		{ "worker_send", &luafunc_worker_send },
+		{ "worker_receive", &luafunc_worker_receive },
+		{ "job_pool_start", &luafunc_job_pool_start },
+		{ "job_submit", &luafunc_job_submit },
+		{ "job_pool_stop", &luafunc_job_pool_stop },
 #endif
 		{ "socket_startup", &luafunc_socket_startup },
 		{ "socket_cleanup", &luafunc_socket_cleanup },
@@ -0,0 +1,236 @@
+/*
+  Copyright 2012-2014 Christopher E. Miller
+  License: GPLv2, see LICENSE file.
+*/
+
+#include "ircring.h"
+
+#ifdef HAS_IRCRING
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#include <lauxlib.h>
+#include <lualib.h>
+#include <lua.h>
+
+
+/* The writer's ring; workers share it, so writes take the lock. */
+static struct
+{
+	pthread_mutex_t lock;
+	IrcRingHeader *header;
+	char *data;
+	size_t mapsize;
+	char name[256];
+	int atexitDone;
+}_ring = { PTHREAD_MUTEX_INITIALIZER, NULL, NULL, 0, "", 0 };
+
+
+static void _closeRing()
+{
+	if(_ring.header)
+	{
+		munmap(_ring.header, _ring.mapsize);
+		shm_unlink(_ring.name);
+		_ring.header = NULL;
+		_ring.data = NULL;
+	}
+}
+
+
+/* Don't leave the segment behind for readers to find. */
+static void _atexitClose()
+{
+	pthread_mutex_lock(&_ring.lock);
+	_closeRing();
+	pthread_mutex_unlock(&_ring.lock);
+}
+
+
+/**	true = ring_open(name [, bytes])
+	Creates the shared memory ring name, such as "/irccmd", for ring_write;
+	bytes is rounded up to a power of two, default 4 MB.
+	Returns nil and an error message if it can't.
+*/
+int luafunc_ring_open(lua_State *L)
+{
+	const char *name = luaL_checkstring(L, 1);
+	size_t want = (size_t)luaL_optinteger(L, 2, 4 * 1024 * 1024);
+	size_t size = 64 * 1024;
+	int fd;
+	void *map;
+	while(size < want && size < ((size_t)1 << 30))
+		size <<= 1;
+	pthread_mutex_lock(&_ring.lock);
+	if(_ring.header && 0 == strcmp(_ring.name, name))
+	{
+		/* Workers parse the same command line, keep the ring readers already have. */
+		pthread_mutex_unlock(&_ring.lock);
+		lua_pushboolean(L, 1);
+		return 1; /* Number of return values. */
+	}
+	_closeRing();
+	fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if(-1 == fd || -1 == ftruncate(fd, IRCRING_HEADER_SIZE + size))
+	{
+		if(-1 != fd)
+		{
+			close(fd);
+			shm_unlink(name);
+		}
+		pthread_mutex_unlock(&_ring.lock);
+		lua_pushnil(L);
+		lua_pushstring(L, strerror(errno));
+		return 2; /* Number of return values. */
+	}
+	map = mmap(NULL, IRCRING_HEADER_SIZE + size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd); /* The mapping stays. */
+	if(MAP_FAILED == map)
+	{
+		shm_unlink(name);
+		pthread_mutex_unlock(&_ring.lock);
+		lua_pushnil(L);
+		lua_pushstring(L, strerror(errno));
+		return 2; /* Number of return values. */
+	}
+	_ring.header = (IrcRingHeader*)map;
+	_ring.data = (char*)map + IRCRING_HEADER_SIZE;
+	_ring.mapsize = IRCRING_HEADER_SIZE + size;
+	snprintf(_ring.name, sizeof(_ring.name), "%s", name);
+	_ring.header->version = IRCRING_VERSION;
+	_ring.header->size = size;
+	__atomic_store_n(&_ring.header->magic, IRCRING_MAGIC, __ATOMIC_RELEASE); /* Ready. */
+	if(!_ring.atexitDone)
+	{
+		atexit(&_atexitClose);
+		_ring.atexitDone = 1;
+	}
+	pthread_mutex_unlock(&_ring.lock);
+	lua_pushboolean(L, 1);
+	return 1; /* Number of return values. */
+}
+
+
+/* Bytes a string takes in a record. */
+static size_t _stringSize(size_t len)
+{
+	return sizeof(uint16_t) + len + 1;
+}
+
+
+static char *_putString(char *p, const char *s, size_t len)
+{
+	uint16_t n = (uint16_t)len;
+	memcpy(p, &n, sizeof(n));
+	p += sizeof(n);
+	memcpy(p, s, len);
+	p[len] = 0;
+	return p + len + 1;
+}
+
+
+/**	ok = ring_write(prefix, cmd, params [, tags [, time [, network]]])
+	Writes an event to the ring from ring_open, see ircring.h for the layout.
+	Returns false if there's no ring or the event is too big for it.
+*/
+int luafunc_ring_write(lua_State *L)
+{
+	size_t lens[4 + IRCRING_MAX_PARAMS];
+	const char *strs[4 + IRCRING_MAX_PARAMS];
+	IrcRingRecord rec;
+	size_t nparams, need, i, nstrs;
+	uint64_t size, head, off, start;
+	luaL_checktype(L, 3, LUA_TTABLE);
+	memset(&rec, 0, sizeof(rec));
+	nparams = lua_objlen(L, 3);
+	if(nparams > IRCRING_MAX_PARAMS)
+		nparams = IRCRING_MAX_PARAMS;
+	luaL_checkstack(L, (int)nparams, "ring_write params");
+	strs[0] = lua_tolstring(L, 1, &lens[0]); /* source */
+	strs[1] = luaL_checklstring(L, 2, &lens[1]); /* command */
+	strs[2] = lua_tolstring(L, 6, &lens[2]); /* network */
+	strs[3] = lua_tolstring(L, 4, &lens[3]); /* tags */
+	for(i = 0; i < nparams; i++)
+	{
+		lua_rawgeti(L, 3, (int)i + 1);
+		strs[4 + i] = lua_tolstring(L, -1, &lens[4 + i]); /* Numbers too; stays on the stack. */
+	}
+	nstrs = 4 + nparams;
+	need = sizeof(rec);
+	for(i = 0; i < nstrs; i++)
+	{
+		if(!strs[i])
+		{
+			strs[i] = "";
+			lens[i] = 0;
+		}
+		if(lens[i] > 0xFFFF)
+			lens[i] = 0xFFFF;
+		need += _stringSize(lens[i]);
+	}
+	need = (need + 7) & ~(size_t)7;
+	if(lens[1] == 3 && strs[1][0] >= '0' && strs[1][0] <= '9' && strs[1][1] >= '0'
+		&& strs[1][1] <= '9' && strs[1][2] >= '0' && strs[1][2] <= '9')
+	{
+		rec.flags |= IRCRING_F_NUMERIC;
+		rec.numeric = (uint16_t)((strs[1][0] - '0') * 100 + (strs[1][1] - '0') * 10 + (strs[1][2] - '0'));
+	}
+	rec.nparams = (uint8_t)nparams;
+	rec.time = lua_isnumber(L, 5) ? lua_tonumber(L, 5) : 0;
+
+	pthread_mutex_lock(&_ring.lock);
+	if(!_ring.header || need > _ring.header->size / 4)
+	{
+		if(_ring.header)
+			_ring.header->dropped++;
+		pthread_mutex_unlock(&_ring.lock);
+		lua_pushboolean(L, 0);
+		return 1; /* Number of return values. */
+	}
+	size = _ring.header->size;
+	head = _ring.header->head;
+	off = head & (size - 1);
+	start = head;
+	if(size - off < need)
+		start += size - off; /* Doesn't fit before the end, pad and start over. */
+	/* Readers see the bytes about to be overwritten are gone before they change. */
+	__atomic_store_n(&_ring.header->reserve, start + need, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if(start != head && size - off >= sizeof(IrcRingRecord))
+	{
+		IrcRingRecord pad;
+		memset(&pad, 0, sizeof(pad));
+		pad.size = (uint32_t)(size - off);
+		pad.flags = IRCRING_F_PAD;
+		memcpy(_ring.data + off, &pad, sizeof(pad));
+	}
+	{
+		char *p = _ring.data + (start & (size - 1));
+		char *q = p + sizeof(rec);
+		rec.size = (uint32_t)need;
+		rec.seq = _ring.header->seq + 1;
+		memcpy(p, &rec, sizeof(rec));
+		for(i = 0; i < nstrs; i++)
+			q = _putString(q, strs[i], lens[i]);
+	}
+	__atomic_store_n(&_ring.header->seq, rec.seq, __ATOMIC_RELAXED);
+	__atomic_store_n(&_ring.header->head, start + need, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&_ring.lock);
+	lua_pushboolean(L, 1);
+	return 1; /* Number of return values. */
+}
+
+
+/**	ring_close()
+	Removes the ring; readers which have it open can still read what was written.
+*/
+int luafunc_ring_close(lua_State *L)
+{
+	(void)L;
+	_atexitClose();
+	return 0; /* Number of return values. */
+}
+
+#endif
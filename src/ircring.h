@@ -0,0 +1,255 @@
+/*
+  Copyright 2012-2014 Christopher E. Miller
+  License: GPLv2, see LICENSE file.
+*/
+
+#ifndef _IRCRING_H_2964
+#define _IRCRING_H_2964
+
+/*	Shared memory ring of IRC events, for programs on the same machine.
+	irccmd (-ring=name) is the only writer, any number of readers map it read only.
+	The writer never waits for readers: a reader too far behind loses events,
+	which it finds out from the sequence numbers.
+
+	This header is all a reader needs:
+		IrcRingReader r;
+		IrcRingEvent ev;
+		if(0 == ircring_open(&r, "/irccmd"))
+			for(;;)
+				if(1 == ircring_next(&r, &ev) && ircring_valid(&r, &ev))
+					use ev.command, ev.params[0], ...
+	The strings point into the ring, so they are only good until ircring_valid
+	says so; check it after using them, or copy them first.
+	See examples/ringreader.c
+*/
+
+#if !defined(WIN32) && !defined(WIN64) && !defined(WINNT)
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define IRCRING_MAGIC 0x52435249 /* "IRCR" */
+#define IRCRING_VERSION 1
+#define IRCRING_HEADER_SIZE 128
+#define IRCRING_MAX_PARAMS 32
+
+/* At the start of the segment, the records follow at IRCRING_HEADER_SIZE. */
+typedef struct
+{
+	uint32_t magic;
+	uint32_t version;
+	uint64_t size; /* Bytes of records, a power of two. */
+	uint64_t head; /* Bytes ever written; the newest record ends here. */
+	uint64_t reserve; /* Bytes written or being written; bytes before reserve - size are gone. */
+	uint64_t seq; /* Sequence number of the newest event, the first is 1. */
+	uint64_t dropped; /* Events too big for the ring. */
+}IrcRingHeader;
+
+#define IRCRING_F_NUMERIC 1 /* numeric is set. */
+#define IRCRING_F_PAD 2 /* Skips to the end of the ring, not an event. */
+
+/*	Records are a multiple of 8 bytes and don't wrap around the end of the ring;
+	if the rest of the ring is smaller than an IrcRingRecord it is skipped too.
+	The record is followed by 4 + nparams strings: source, command, network, tags
+	(raw, as from irc_parse) and the params. Each is a uint16_t length,
+	the bytes, and a 0 which isn't counted.
+*/
+typedef struct
+{
+	uint32_t size;
+	uint16_t numeric;
+	uint8_t nparams;
+	uint8_t flags;
+	uint64_t seq;
+	double time; /* Seconds since the epoch when the line arrived. */
+}IrcRingRecord;
+
+
+typedef struct
+{
+	uint64_t seq;
+	double time;
+	int numeric; /* -1 if not a numeric. */
+	const char *source, *command, *network, *tags; /* "" if none. */
+	size_t sourcelen, commandlen, networklen, tagslen;
+	int nparams;
+	const char *params[IRCRING_MAX_PARAMS];
+	size_t paramlens[IRCRING_MAX_PARAMS];
+	uint64_t start; /* Where the record is in the ring, for ircring_valid. */
+}IrcRingEvent;
+
+
+typedef struct
+{
+	const IrcRingHeader *header;
+	const char *data;
+	size_t mapsize;
+	uint64_t pos; /* Next record to read. */
+	uint64_t seq; /* Of the last event read. */
+	uint64_t lost; /* Events missed by falling behind. */
+	int fd;
+}IrcRingReader;
+
+
+#define _ircring_load(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+
+
+/*	Returns 1 if ev, from ircring_next, has not been overwritten since;
+	so what was read from it is good.
+*/
+static inline int ircring_valid(const IrcRingReader *r, const IrcRingEvent *ev)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE); /* Reads of the event happen first. */
+	return __atomic_load_n(&r->header->reserve, __ATOMIC_RELAXED) <= ev->start + r->header->size;
+}
+
+
+/* Reads a string of a record, returns the position after it or 0 if it's bad. */
+static inline size_t _ircring_string(const char *rec, size_t at, size_t size,
+	const char **s, size_t *len)
+{
+	uint16_t n;
+	if(at + sizeof(n) > size)
+		return 0;
+	memcpy(&n, rec + at, sizeof(n));
+	at += sizeof(n);
+	if(at + n + 1 > size)
+		return 0;
+	*s = rec + at;
+	*len = n;
+	return at + n + 1;
+}
+
+
+/*	Returns 1 and fills in ev for the next event, 0 if there are none yet,
+	or -1 if the reader fell behind and skipped to the newest events.
+*/
+static inline int ircring_next(IrcRingReader *r, IrcRingEvent *ev)
+{
+	const uint64_t size = r->header->size;
+	for(;;)
+	{
+		IrcRingRecord rec;
+		const char *p;
+		uint64_t off, head = _ircring_load(&r->header->head);
+		size_t at;
+		int i;
+		if(r->pos == head)
+			return 0;
+		if(head - r->pos > size)
+			goto overrun;
+		off = r->pos & (size - 1);
+		if(size - off < sizeof(IrcRingRecord))
+		{
+			r->pos += size - off;
+			continue;
+		}
+		p = r->data + off;
+		memcpy(&rec, p, sizeof(rec));
+		if(rec.size < sizeof(rec) || rec.size > size - off || (rec.size & 7))
+			goto overrun;
+		if(rec.flags & IRCRING_F_PAD)
+		{
+			r->pos += rec.size;
+			continue;
+		}
+		ev->seq = rec.seq;
+		ev->time = rec.time;
+		ev->numeric = (rec.flags & IRCRING_F_NUMERIC) ? rec.numeric : -1;
+		ev->nparams = rec.nparams < IRCRING_MAX_PARAMS ? rec.nparams : IRCRING_MAX_PARAMS;
+		at = sizeof(rec);
+		if(!(at = _ircring_string(p, at, rec.size, &ev->source, &ev->sourcelen))
+			|| !(at = _ircring_string(p, at, rec.size, &ev->command, &ev->commandlen))
+			|| !(at = _ircring_string(p, at, rec.size, &ev->network, &ev->networklen))
+			|| !(at = _ircring_string(p, at, rec.size, &ev->tags, &ev->tagslen)))
+			goto overrun;
+		for(i = 0; i < ev->nparams; i++)
+		{
+			if(!(at = _ircring_string(p, at, rec.size, &ev->params[i], &ev->paramlens[i])))
+				goto overrun;
+		}
+		ev->start = r->pos;
+		if(!ircring_valid(r, ev))
+			goto overrun;
+		if(r->seq && rec.seq > r->seq + 1)
+			r->lost += rec.seq - r->seq - 1;
+		r->seq = rec.seq;
+		r->pos += rec.size;
+		return 1;
+	overrun:
+		/* Records can only be found from one to the next, start again at the newest. */
+		r->pos = _ircring_load(&r->header->head);
+		return -1;
+	}
+}
+
+
+static inline void ircring_close(IrcRingReader *r)
+{
+	if(r->header)
+		munmap((void*)r->header, r->mapsize);
+	if(r->fd > 0)
+		close(r->fd);
+	memset(r, 0, sizeof(*r));
+}
+
+
+/*	Opens the ring created by irccmd -ring=name, such as "/irccmd".
+	Reading starts with the next event written. Returns 0, or -1 with errno set.
+*/
+static inline int ircring_open(IrcRingReader *r, const char *name)
+{
+	struct stat st;
+	void *map;
+	memset(r, 0, sizeof(*r));
+	r->fd = shm_open(name, O_RDONLY, 0);
+	if(-1 == r->fd)
+		return -1;
+	if(-1 == fstat(r->fd, &st) || (size_t)st.st_size < IRCRING_HEADER_SIZE)
+	{
+		close(r->fd);
+		errno = EINVAL;
+		return -1;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, r->fd, 0);
+	if(MAP_FAILED == map)
+	{
+		close(r->fd);
+		return -1;
+	}
+	r->header = (const IrcRingHeader*)map;
+	r->data = (const char*)map + IRCRING_HEADER_SIZE;
+	r->mapsize = st.st_size;
+	if(r->header->magic != IRCRING_MAGIC || r->header->version != IRCRING_VERSION
+		|| r->header->size + IRCRING_HEADER_SIZE > r->mapsize)
+	{
+		ircring_close(r);
+		errno = EINVAL;
+		return -1;
+	}
+	r->pos = _ircring_load(&r->header->head);
+	r->seq = _ircring_load(&r->header->seq);
+	return 0;
+}
+
+
+/*	Used by irccmd_internal, see ircring.c for the writer:
+	ring_open(name [, bytes]) (a no-op if name is already open), ring_write(prefix, cmd, params [, tags [, time [, network]]])
+	and ring_close().
+*/
+struct lua_State;
+int luafunc_ring_open(struct lua_State *L);
+int luafunc_ring_write(struct lua_State *L);
+int luafunc_ring_close(struct lua_State *L);
+
+#define HAS_IRCRING
+
+#endif
+
+#endif
@@ -0,0 +1,318 @@
+/*
+  Copyright 2012-2014 Christopher E. Miller
+  License: GPLv2, see LICENSE file.
+*/
+
+#include "outbuf.h"
+
+#ifdef HAS_OUTBUF
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <limits.h>
+
+#include <lauxlib.h>
+#include <lualib.h>
+#include <lua.h>
+
+
+/* Waiting output is a ring of cap bytes, from head for len bytes. */
+typedef struct
+{
+	pthread_mutex_t lock;
+	char *data;
+	size_t cap, head, len;
+	size_t flushBytes;
+	unsigned long latency; /* microseconds */
+	unsigned long long since; /* When the oldest waiting byte was buffered. */
+	unsigned long long dropped;
+	int on;
+	int atexitDone;
+}OutBuf;
+
+static OutBuf _out = { PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+
+
+static unsigned long long _micros()
+{
+	struct timeval tv;
+#ifdef CLOCK_MONOTONIC
+	struct timespec ts;
+	if(0 == clock_gettime(CLOCK_MONOTONIC, &ts))
+		return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+	if(-1 == gettimeofday(&tv, NULL))
+		return 0;
+	return (unsigned long long)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+
+/*	How many bytes stdout takes right now without blocking; 0 if none.
+	*sock is set if stdout is a socket, which is written with MSG_DONTWAIT instead.
+	stdout itself stays blocking: O_NONBLOCK, even on a dup, would be seen by stdio too.
+*/
+static size_t _writable(size_t want, int *sock)
+{
+	struct pollfd pfd;
+	struct stat st;
+	*sock = 0;
+	pfd.fd = STDOUT_FILENO;
+	pfd.events = POLLOUT;
+	pfd.revents = 0;
+	if(1 != poll(&pfd, 1, 0) || !(pfd.revents & POLLOUT))
+		return (pfd.revents & (POLLERR | POLLHUP)) ? want : 0; /* Let write report errors. */
+	if(-1 == fstat(STDOUT_FILENO, &st) || S_ISREG(st.st_mode) || S_ISBLK(st.st_mode))
+		return want; /* Files don't wait for a reader. */
+	if(S_ISSOCK(st.st_mode))
+	{
+		*sock = 1;
+		return want;
+	}
+	/* POLLOUT only promises PIPE_BUF to a pipe or tty, a bigger write could block. */
+	if(S_ISFIFO(st.st_mode))
+	{
+		size_t room = PIPE_BUF;
+#if defined(F_GETPIPE_SZ) && defined(FIONREAD)
+		/* The pipe holds F_GETPIPE_SZ / page size pages; the unread bytes can take
+			one more page than they fill, the first one being partly read. */
+		long page = sysconf(_SC_PAGESIZE);
+		int size = fcntl(STDOUT_FILENO, F_GETPIPE_SZ);
+		int unread = 0;
+		if(page > 0 && size > 0 && 0 == ioctl(STDOUT_FILENO, FIONREAD, &unread))
+		{
+			long pages = size / page;
+			long used = (unread + page - 1) / page + 1;
+			if(pages > used && (size_t)((pages - used) * page) > room)
+				room = (size_t)((pages - used) * page);
+		}
+#endif
+		return want < room ? want : room;
+	}
+	return want < PIPE_BUF ? want : PIPE_BUF;
+}
+
+
+/* Writes what stdout takes without blocking, or everything if block; lock held. */
+static void _flush(int block)
+{
+	while(_out.len)
+	{
+		struct iovec iov[2];
+		int niov = 1;
+		int sock = 0;
+		size_t n = block ? _out.len : _writable(_out.len, &sock);
+		ssize_t written;
+		if(!n)
+			break;
+		iov[0].iov_base = _out.data + _out.head;
+		iov[0].iov_len = n;
+		if(_out.head + n > _out.cap)
+		{
+			iov[0].iov_len = _out.cap - _out.head;
+			iov[1].iov_base = _out.data;
+			iov[1].iov_len = n - iov[0].iov_len;
+			niov = 2;
+		}
+		if(sock)
+		{
+			struct msghdr msg;
+			memset(&msg, 0, sizeof(msg));
+			msg.msg_iov = iov;
+			msg.msg_iovlen = niov;
+			written = sendmsg(STDOUT_FILENO, &msg, MSG_DONTWAIT);
+			if(written < 0 && errno == ENOTSOCK)
+				written = writev(STDOUT_FILENO, iov, niov);
+		}
+		else
+		{
+			written = writev(STDOUT_FILENO, iov, niov);
+		}
+		if(written < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			if(errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			/* stdout is gone, drop the output rather than keep it forever. */
+			_out.dropped += _out.len;
+			written = _out.len;
+		}
+		_out.head = (_out.head + written) % _out.cap;
+		_out.len -= written;
+	}
+	if(!_out.len)
+		_out.head = 0;
+	_out.since = _micros();
+}
+
+
+/* Makes room for n bytes if it can, without blocking; lock held. */
+static int _room(size_t n)
+{
+	if(n > _out.cap - _out.len)
+	{
+		_flush(0);
+		if(n > _out.cap - _out.len)
+			return 0;
+	}
+	return 1;
+}
+
+
+/* The caller makes room first. */
+static void _append(const char *s, size_t n)
+{
+	size_t tail, first;
+	if(!_out.len)
+		_out.since = _micros();
+	tail = (_out.head + _out.len) % _out.cap;
+	first = _out.cap - tail < n ? _out.cap - tail : n;
+	memcpy(_out.data + tail, s, first);
+	memcpy(_out.data, s + first, n - first);
+	_out.len += n;
+}
+
+
+static void _atexitFlush()
+{
+	pthread_mutex_lock(&_out.lock);
+	if(_out.on)
+		_flush(1);
+	pthread_mutex_unlock(&_out.lock);
+}
+
+
+int luafunc_console_buffer(lua_State *L)
+{
+	pthread_mutex_lock(&_out.lock);
+	if(!lua_toboolean(L, 1))
+	{
+		if(_out.on)
+			_flush(1);
+		_out.on = 0;
+		free(_out.data);
+		_out.data = NULL;
+		_out.cap = _out.head = _out.len = 0;
+	}
+	else
+	{
+		lua_Number latency = luaL_checknumber(L, 1);
+		size_t maxBytes = (size_t)luaL_optinteger(L, 3, 4 * 1024 * 1024);
+		_out.flushBytes = (size_t)luaL_optinteger(L, 2, 64 * 1024);
+		_out.latency = latency > 0 ? (unsigned long)(latency * 1000) : 0;
+		if(maxBytes < _out.flushBytes)
+			maxBytes = _out.flushBytes;
+		if(maxBytes != _out.cap)
+		{
+			char *data;
+			if(_out.on)
+				_flush(1);
+			data = (char*)realloc(_out.data, maxBytes);
+			if(!data)
+			{
+				pthread_mutex_unlock(&_out.lock);
+				return luaL_error(L, "Out of memory for the console buffer");
+			}
+			_out.data = data;
+			_out.cap = maxBytes;
+			_out.head = _out.len = 0;
+		}
+		if(!_out.on)
+		{
+			fflush(stdout); /* Keep what stdio has first. */
+			_out.on = 1;
+		}
+		if(!_out.atexitDone)
+		{
+			atexit(&_atexitFlush);
+			_out.atexitDone = 1;
+		}
+	}
+	pthread_mutex_unlock(&_out.lock);
+	return 0; /* Number of return values. */
+}
+
+
+int luafunc_console_flush(lua_State *L)
+{
+	int nret = 1;
+	pthread_mutex_lock(&_out.lock);
+	if(_out.len)
+	{
+		unsigned long long age = _micros() - _out.since;
+		if(lua_toboolean(L, 1) || age >= _out.latency || _out.len >= _out.flushBytes)
+		{
+			_flush(0);
+			age = 0;
+		}
+		if(_out.len)
+			lua_pushnumber(L, (lua_Number)(age < _out.latency ? _out.latency - age : 0));
+		else
+			lua_pushnil(L);
+	}
+	else
+	{
+		lua_pushnil(L);
+	}
+	if(_out.dropped)
+	{
+		lua_pushnumber(L, (lua_Number)_out.dropped);
+		nret++;
+	}
+	pthread_mutex_unlock(&_out.lock);
+	return nret; /* Number of return values. */
+}
+
+
+int outbuf_print(lua_State *L)
+{
+	int iarg;
+	size_t total = 0;
+	if(!_out.on)
+		return 0;
+	pthread_mutex_lock(&_out.lock);
+	if(!_out.on)
+	{
+		pthread_mutex_unlock(&_out.lock);
+		return 0;
+	}
+	for(iarg = 1; !lua_isnone(L, iarg); iarg++)
+	{
+		size_t len;
+		if(lua_tolstring(L, iarg, &len)) /* Convert to string, or return NULL. */
+			total += len;
+	}
+	if(!_room(total))
+	{
+		/* Whole prints are dropped, not parts of lines. */
+		_out.dropped += total;
+	}
+	else
+	{
+		for(iarg = 1; !lua_isnone(L, iarg); iarg++)
+		{
+			size_t len;
+			const char *s = lua_tolstring(L, iarg, &len);
+			if(s)
+				_append(s, len);
+		}
+	}
+	if(_out.len >= _out.flushBytes)
+		_flush(0);
+	pthread_mutex_unlock(&_out.lock);
+	return 1;
+}
+
+#endif
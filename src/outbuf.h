@@ -0,0 +1,43 @@
+/*
+  Copyright 2012-2014 Christopher E. Miller
+  License: GPLv2, see LICENSE file.
+*/
+
+#ifndef _OUTBUF_H_5518
+#define _OUTBUF_H_5518
+
+/*	Buffered console output: console_print collects the lines of a loop iteration
+	and they are written to stdout together with one writev, once they are
+	latency milliseconds old or flushBytes are waiting.
+	A full pipe, tty or socket never blocks, the lines wait for the next flush instead.
+*/
+
+#if !defined(WIN32) && !defined(WIN64) && !defined(WINNT)
+
+struct lua_State;
+
+/*	console_buffer(latency [, flushBytes [, maxBytes]])
+	Starts buffering console_print output, or changes the limits.
+	latency is in milliseconds; nil or false stops buffering, writing what's left.
+	flushBytes defaults to 64 KB; when more than maxBytes (default 4 MB) are waiting,
+	lines are dropped, see console_flush.
+*/
+int luafunc_console_buffer(struct lua_State *L);
+
+/*	wait, dropped = console_flush([force])
+	Writes the waiting output if it's due, or if force; never blocks.
+	Returns the microseconds until the rest is due, or nil if nothing is waiting;
+	and how many bytes have been dropped so far.
+*/
+int luafunc_console_flush(struct lua_State *L);
+
+/*	Returns 1 if the arguments of console_print were buffered,
+	0 if not buffering, so they should be printed as usual.
+*/
+int outbuf_print(struct lua_State *L);
+
+#define HAS_OUTBUF
+
+#endif
+
+#endif
@@ -0,0 +1,647 @@
+/*
+  Copyright 2012-2014 Christopher E. Miller
+  License: GPLv2, see LICENSE file.
+*/
+
+#include "workers.h"
+
+#ifdef HAS_WORKERS
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+#include <lauxlib.h>
+#include <lualib.h>
+#include <lua.h>
+
+
+typedef struct WorkerMessage_
+{
+	struct WorkerMessage_ *next;
+	int from;
+	size_t len;
+	char data[1];
+}WorkerMessage;
+
+
+typedef struct WorkerMailbox_
+{
+	pthread_mutex_t lock;
+	WorkerMessage *head, *tail;
+	int fds[2]; /* Written to fds[1] for each message; an eventfd on Linux, otherwise a pipe. */
+}WorkerMailbox;
+
+
+typedef struct WorkerStart_
+{
+	int id;
+	int argc; /* argv[0] is the interpreter, argv[1] the script. */
+	char **argv;
+	char *chunk; /* Lua code to run instead of a script, if set. */
+	char *path, *cpath;
+}WorkerStart;
+
+
+typedef struct Job_
+{
+	struct Job_ *next;
+	int owner; /* Mailbox for the result. */
+	int id;
+	char *module, *func, *args;
+	size_t argslen;
+}Job;
+
+
+static pthread_mutex_t _workersLock = PTHREAD_MUTEX_INITIALIZER;
+static WorkerMailbox *_mailboxes[WORKERS_MAX];
+static pthread_t _workerThreads[WORKERS_MAX];
+static int _workerRunning[WORKERS_MAX];
+
+static pthread_mutex_t _jobsLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t _jobsCond = PTHREAD_COND_INITIALIZER;
+static Job *_jobsHead = NULL, *_jobsTail = NULL;
+static pthread_t _jobThreads[JOBS_MAX_THREADS];
+static int _jobThreadCount = 0;
+static int _jobsStopping = 0;
+static char *_jobsPath = NULL, *_jobsCpath = NULL;
+
+
+static char *_strdupnull(const char *s)
+{
+	char *result;
+	if(!s)
+		return NULL;
+	result = (char*)malloc(strlen(s) + 1);
+	if(result)
+		strcpy(result, s);
+	return result;
+}
+
+
+/**	Same as _getMailbox, with _workersLock held. */
+static WorkerMailbox *_getMailboxLocked(int id)
+{
+	WorkerMailbox *mb = _mailboxes[id];
+	if(!mb)
+	{
+		mb = (WorkerMailbox*)calloc(1, sizeof(WorkerMailbox));
+		if(mb)
+		{
+#ifdef __linux__
+			mb->fds[0] = mb->fds[1] = eventfd(0, EFD_NONBLOCK);
+			if(-1 == mb->fds[0])
+#else
+			if(-1 == pipe(mb->fds))
+#endif
+			{
+				free(mb);
+				mb = NULL;
+			}
+			else
+			{
+#ifndef __linux__
+				fcntl(mb->fds[0], F_SETFL, fcntl(mb->fds[0], F_GETFL, 0) | O_NONBLOCK);
+				fcntl(mb->fds[1], F_SETFL, fcntl(mb->fds[1], F_GETFL, 0) | O_NONBLOCK);
+#endif
+				pthread_mutex_init(&mb->lock, NULL);
+				_mailboxes[id] = mb;
+			}
+		}
+	}
+	return mb;
+}
+
+
+/**	Returns the mailbox, creating it if needed; NULL if id is invalid. */
+static WorkerMailbox *_getMailbox(int id)
+{
+	WorkerMailbox *mb;
+	if(id < 0 || id >= WORKERS_MAX)
+		return NULL;
+	pthread_mutex_lock(&_workersLock);
+	mb = _getMailboxLocked(id);
+	pthread_mutex_unlock(&_workersLock);
+	return mb;
+}
+
+
+static void _wakeMailbox(WorkerMailbox *mb)
+{
+	/* If the pipe is full the reader has plenty of wakeups already. */
+#ifdef __linux__
+	uint64_t one = 1;
+	while(-1 == write(mb->fds[1], &one, sizeof(one)) && EINTR == errno)
+#else
+	while(-1 == write(mb->fds[1], "", 1) && EINTR == errno)
+#endif
+	{
+	}
+}
+
+
+static void _drainMailbox(WorkerMailbox *mb)
+{
+#ifdef __linux__
+	uint64_t count;
+	while(-1 == read(mb->fds[0], &count, sizeof(count)) && EINTR == errno)
+	{
+	}
+#else
+	char drain[256];
+	while(read(mb->fds[0], drain, sizeof(drain)) > 0)
+	{
+	}
+#endif
+}
+
+
+/**	Adds a copy of data to the mailbox; returns 0 if out of memory. */
+static int _postMessage(WorkerMailbox *mb, int from, const char *data, size_t len)
+{
+	WorkerMessage *msg = (WorkerMessage*)malloc(sizeof(WorkerMessage) + len);
+	if(!msg)
+		return 0;
+	msg->next = NULL;
+	msg->from = from;
+	msg->len = len;
+	memcpy(msg->data, data, len);
+	pthread_mutex_lock(&mb->lock);
+	if(mb->tail)
+		mb->tail->next = msg;
+	else
+		mb->head = msg;
+	mb->tail = msg;
+	pthread_mutex_unlock(&mb->lock);
+	_wakeMailbox(mb);
+	return 1;
+}
+
+
+/**	A new lua_State with the standard libraries, package paths and worker_id set. */
+static lua_State *_newWorkerState(int id, const char *path, const char *cpath)
+{
+	lua_State *L = luaL_newstate();
+	if(!L)
+		return NULL;
+	luaL_openlibs(L);
+	lua_getglobal(L, "package");
+	if(path)
+	{
+		lua_pushstring(L, path);
+		lua_setfield(L, -2, "path");
+	}
+	if(cpath)
+	{
+		lua_pushstring(L, cpath);
+		lua_setfield(L, -2, "cpath");
+	}
+	lua_pop(L, 1);
+	lua_pushinteger(L, id);
+	lua_setglobal(L, "worker_id");
+	return L;
+}
+
+
+static void _freeWorkerStart(WorkerStart *ws)
+{
+	int i;
+	for(i = 0; ws->argv && i < ws->argc; i++)
+		free(ws->argv[i]);
+	free(ws->argv);
+	free(ws->chunk);
+	free(ws->path);
+	free(ws->cpath);
+	free(ws);
+}
+
+
+static void *_workerThreadProc(void *param)
+{
+	WorkerStart *ws = (WorkerStart*)param;
+	lua_State *L = _newWorkerState(ws->id, ws->path, ws->cpath);
+	if(L && ws->chunk)
+	{
+		if(luaL_loadstring(L, ws->chunk) || lua_pcall(L, 0, 0, 0))
+			fprintf(stderr, "Worker %d: %s\n", ws->id, lua_tostring(L, -1));
+		lua_close(L);
+	}
+	else if(L)
+	{
+		int i;
+		/* arg[-1] is the interpreter, arg[0] the script. */
+		lua_createtable(L, ws->argc, 1);
+		for(i = 0; i < ws->argc; i++)
+		{
+			lua_pushstring(L, ws->argv[i]);
+			lua_rawseti(L, -2, i - 1);
+		}
+		lua_setglobal(L, "arg");
+		if(luaL_loadfile(L, ws->argv[1]))
+		{
+			fprintf(stderr, "Worker %d: %s\n", ws->id, lua_tostring(L, -1));
+		}
+		else
+		{
+			for(i = 2; i < ws->argc; i++)
+				lua_pushstring(L, ws->argv[i]);
+			if(lua_pcall(L, ws->argc - 2, 0, 0))
+				fprintf(stderr, "Worker %d: %s\n", ws->id, lua_tostring(L, -1));
+		}
+		lua_close(L);
+	}
+	_freeWorkerStart(ws);
+	return NULL;
+}
+
+
+int luafunc_worker_start(lua_State *L)
+{
+	int id = luaL_checkint(L, 1);
+	WorkerStart *ws;
+	int i;
+	if(!lua_istable(L, 2))
+		luaL_checktype(L, 2, LUA_TSTRING);
+	if(id < 0 || id >= WORKERS_MAX)
+	{
+		lua_pushnil(L);
+		lua_pushstring(L, "Invalid worker id");
+		return 2; /* Number of return values. */
+	}
+	ws = (WorkerStart*)calloc(1, sizeof(WorkerStart));
+	if(!ws)
+		return luaL_error(L, "Out of memory");
+	if(lua_istable(L, 2))
+	{
+		ws->argc = lua_objlen(L, 2) + 1;
+		ws->argv = (char**)calloc(ws->argc, sizeof(char*));
+		for(i = 0; ws->argv && i < ws->argc; i++)
+		{
+			lua_rawgeti(L, 2, i);
+			ws->argv[i] = _strdupnull(lua_isstring(L, -1) ? lua_tostring(L, -1) : "");
+			lua_pop(L, 1);
+		}
+		if(ws->argc < 2)
+		{
+			_freeWorkerStart(ws);
+			lua_pushnil(L);
+			lua_pushstring(L, "Script expected in argv[1]");
+			return 2; /* Number of return values. */
+		}
+	}
+	else
+	{
+		ws->chunk = _strdupnull(lua_tostring(L, 2));
+	}
+	ws->path = _strdupnull(lua_tostring(L, 3));
+	ws->cpath = _strdupnull(lua_tostring(L, 4));
+
+	/* The id is picked, its mailbox made and the thread started under one lock,
+		so threads starting workers at the same time can't pick the same id. */
+	pthread_mutex_lock(&_workersLock);
+	if(!id)
+	{
+		/* Pick an id which was never used, from the top down;
+			the low ids are left for -workers, which start them by number. */
+		for(id = WORKERS_MAX - 1; id > 0; id--)
+		{
+			if(!_workerRunning[id] && !_mailboxes[id])
+				break;
+		}
+		if(!id)
+		{
+			pthread_mutex_unlock(&_workersLock);
+			_freeWorkerStart(ws);
+			lua_pushnil(L);
+			lua_pushstring(L, "Too many workers");
+			return 2; /* Number of return values. */
+		}
+	}
+	ws->id = id;
+	if(!_getMailboxLocked(id))
+	{
+		pthread_mutex_unlock(&_workersLock);
+		_freeWorkerStart(ws);
+		lua_pushnil(L);
+		lua_pushstring(L, "Unable to create worker mailbox");
+		return 2; /* Number of return values. */
+	}
+	if(_workerRunning[id])
+	{
+		pthread_mutex_unlock(&_workersLock);
+		_freeWorkerStart(ws);
+		lua_pushnil(L);
+		lua_pushstring(L, "Worker already started");
+		return 2; /* Number of return values. */
+	}
+	if(pthread_create(&_workerThreads[id], NULL, &_workerThreadProc, ws))
+	{
+		pthread_mutex_unlock(&_workersLock);
+		_freeWorkerStart(ws);
+		lua_pushnil(L);
+		lua_pushstring(L, "Unable to start worker thread");
+		return 2; /* Number of return values. */
+	}
+	_workerRunning[id] = 1;
+	pthread_mutex_unlock(&_workersLock);
+	lua_pushinteger(L, id);
+	return 1; /* Number of return values. */
+}
+
+
+int luafunc_worker_join(lua_State *L)
+{
+	int id = luaL_checkint(L, 1);
+	pthread_t thread;
+	if(id <= 0 || id >= WORKERS_MAX)
+		return 0;
+	pthread_mutex_lock(&_workersLock);
+	if(!_workerRunning[id])
+	{
+		pthread_mutex_unlock(&_workersLock);
+		return 0;
+	}
+	thread = _workerThreads[id];
+	_workerRunning[id] = 0;
+	pthread_mutex_unlock(&_workersLock);
+	pthread_join(thread, NULL);
+	lua_pushboolean(L, 1);
+	return 1; /* Number of return values. */
+}
+
+
+int luafunc_worker_mailbox(lua_State *L)
+{
+	WorkerMailbox *mb = _getMailbox(luaL_checkint(L, 1));
+	if(!mb)
+	{
+		lua_pushnil(L);
+		lua_pushstring(L, "Invalid worker mailbox");
+		return 2; /* Number of return values. */
+	}
+	lua_pushinteger(L, mb->fds[0]);
+	return 1; /* Number of return values. */
+}
+
+
+int luafunc_worker_send(lua_State *L)
+{
+	WorkerMailbox *mb = _getMailbox(luaL_checkint(L, 1));
+	int from = luaL_checkint(L, 2);
+	size_t len;
+	const char *data = luaL_checklstring(L, 3, &len);
+	if(!mb)
+	{
+		lua_pushnil(L);
+		lua_pushstring(L, "Invalid worker mailbox");
+		return 2; /* Number of return values. */
+	}
+	if(!_postMessage(mb, from, data, len))
+		return luaL_error(L, "Out of memory");
+	lua_pushboolean(L, 1);
+	return 1; /* Number of return values. */
+}
+
+
+int luafunc_worker_receive(lua_State *L)
+{
+	WorkerMailbox *mb = _getMailbox(luaL_checkint(L, 1));
+	int max = luaL_optint(L, 2, 0);
+	WorkerMessage *msg, *next;
+	int n = 0;
+	if(!mb)
+		return 0;
+	/* Drain the wakeups before taking the messages,
+		so a message sent meanwhile still leaves its wakeup. */
+	_drainMailbox(mb);
+	pthread_mutex_lock(&mb->lock);
+	msg = mb->head;
+	if(max > 0)
+	{
+		WorkerMessage *last = msg;
+		for(n = 1; last && n < max; n++)
+			last = last->next;
+		if(last)
+		{
+			mb->head = last->next;
+			last->next = NULL;
+		}
+		else
+		{
+			mb->head = NULL;
+		}
+	}
+	else
+	{
+		mb->head = NULL;
+	}
+	if(!mb->head)
+		mb->tail = NULL;
+	else
+		_wakeMailbox(mb); /* Leave the rest for the next select. */
+	pthread_mutex_unlock(&mb->lock);
+	if(!msg)
+		return 0;
+	lua_newtable(L);
+	lua_newtable(L);
+	for(n = 1; msg; msg = next, n++)
+	{
+		next = msg->next;
+		lua_pushlstring(L, msg->data, msg->len);
+		lua_rawseti(L, -3, n);
+		lua_pushinteger(L, msg->from);
+		lua_rawseti(L, -2, n);
+		free(msg);
+	}
+	return 2; /* Number of return values. */
+}
+
+
+static void _freeJob(Job *job)
+{
+	free(job->module);
+	free(job->func);
+	free(job->args);
+	free(job);
+}
+
+
+/**	Runs jobs until job_pool_stop; each thread has its own lua_State. */
+static void *_jobThreadProc(void *param)
+{
+	lua_State *L;
+	(void)param;
+	pthread_mutex_lock(&_jobsLock);
+	L = _newWorkerState(JOBS_SENDER, _jobsPath, _jobsCpath);
+	pthread_mutex_unlock(&_jobsLock);
+	if(L)
+	{
+		lua_getglobal(L, "require");
+		lua_pushstring(L, "jobs");
+		if(lua_pcall(L, 1, 0, 0))
+		{
+			fprintf(stderr, "Job thread: %s\n", lua_tostring(L, -1));
+			lua_pop(L, 1);
+		}
+	}
+	for(;;)
+	{
+		Job *job;
+		WorkerMailbox *mb;
+		pthread_mutex_lock(&_jobsLock);
+		while(!_jobsHead && !_jobsStopping)
+			pthread_cond_wait(&_jobsCond, &_jobsLock);
+		job = _jobsHead;
+		if(job)
+		{
+			_jobsHead = job->next;
+			if(!_jobsHead)
+				_jobsTail = NULL;
+		}
+		pthread_mutex_unlock(&_jobsLock);
+		if(!job)
+			break; /* Stopping and no more jobs. */
+
+		mb = _getMailbox(job->owner);
+		/* jobRun(id, module, func, args) returns the serialized result message. */
+		if(L)
+			lua_getglobal(L, "jobRun");
+		if(L && lua_isfunction(L, -1))
+		{
+			lua_pushinteger(L, job->id);
+			lua_pushstring(L, job->module);
+			lua_pushstring(L, job->func);
+			lua_pushlstring(L, job->args, job->argslen);
+			if(0 == lua_pcall(L, 4, 1, 0) && lua_isstring(L, -1))
+			{
+				size_t len;
+				const char *result = lua_tolstring(L, -1, &len);
+				if(mb)
+					_postMessage(mb, JOBS_SENDER, result, len);
+				lua_pop(L, 1);
+				_freeJob(job);
+				continue;
+			}
+		}
+		if(L)
+			lua_settop(L, 0);
+		if(mb)
+		{
+			char failed[64];
+			sprintf(failed, "return %d, false, \"Unable to run job\"", job->id);
+			_postMessage(mb, JOBS_SENDER, failed, strlen(failed));
+		}
+		_freeJob(job);
+	}
+	if(L)
+		lua_close(L);
+	return NULL;
+}
+
+
+int luafunc_job_pool_start(lua_State *L)
+{
+	int nthreads = luaL_checkint(L, 1);
+	const char *path = lua_tostring(L, 2);
+	const char *cpath = lua_tostring(L, 3);
+	if(nthreads > JOBS_MAX_THREADS)
+		nthreads = JOBS_MAX_THREADS;
+	pthread_mutex_lock(&_jobsLock);
+	if(!_jobThreadCount)
+	{
+		free(_jobsPath);
+		free(_jobsCpath);
+		_jobsPath = _strdupnull(path);
+		_jobsCpath = _strdupnull(cpath);
+		_jobsStopping = 0;
+		while(_jobThreadCount < nthreads)
+		{
+			if(pthread_create(&_jobThreads[_jobThreadCount], NULL, &_jobThreadProc, NULL))
+				break;
+			_jobThreadCount++;
+		}
+	}
+	lua_pushinteger(L, _jobThreadCount);
+	pthread_mutex_unlock(&_jobsLock);
+	return 1; /* Number of return values. */
+}
+
+
+int luafunc_job_submit(lua_State *L)
+{
+	int owner = luaL_checkint(L, 1);
+	int id = luaL_checkint(L, 2);
+	const char *module = luaL_checkstring(L, 3);
+	const char *func = luaL_checkstring(L, 4);
+	size_t argslen;
+	const char *args = luaL_checklstring(L, 5, &argslen);
+	Job *job;
+	if(!_getMailbox(owner))
+	{
+		lua_pushnil(L);
+		lua_pushstring(L, "Invalid worker mailbox");
+		return 2; /* Number of return values. */
+	}
+	job = (Job*)calloc(1, sizeof(Job));
+	if(!job)
+		return luaL_error(L, "Out of memory");
+	job->owner = owner;
+	job->id = id;
+	job->module = _strdupnull(module);
+	job->func = _strdupnull(func);
+	job->args = (char*)malloc(argslen + 1);
+	if(!job->module || !job->func || !job->args)
+	{
+		_freeJob(job);
+		return luaL_error(L, "Out of memory");
+	}
+	memcpy(job->args, args, argslen);
+	job->argslen = argslen;
+	pthread_mutex_lock(&_jobsLock);
+	if(!_jobThreadCount)
+	{
+		pthread_mutex_unlock(&_jobsLock);
+		_freeJob(job);
+		lua_pushnil(L);
+		lua_pushstring(L, "Job pool not started");
+		return 2; /* Number of return values. */
+	}
+	if(_jobsTail)
+		_jobsTail->next = job;
+	else
+		_jobsHead = job;
+	_jobsTail = job;
+	pthread_cond_signal(&_jobsCond);
+	pthread_mutex_unlock(&_jobsLock);
+	lua_pushboolean(L, 1);
+	return 1; /* Number of return values. */
+}
+
+
+int luafunc_job_pool_stop(lua_State *L)
+{
+	int i, n;
+	pthread_mutex_lock(&_jobsLock);
+	n = _jobThreadCount;
+	_jobsStopping = 1;
+	pthread_cond_broadcast(&_jobsCond);
+	pthread_mutex_unlock(&_jobsLock);
+	for(i = 0; i < n; i++)
+		pthread_join(_jobThreads[i], NULL);
+	pthread_mutex_lock(&_jobsLock);
+	_jobThreadCount = 0;
+	pthread_mutex_unlock(&_jobsLock);
+	(void)L;
+	return 0; /* Number of return values. */
+}
+
+#endif
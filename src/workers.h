@@ -0,0 +1,81 @@
+/*
+  Copyright 2012-2014 Christopher E. Miller
+  License: GPLv2, see LICENSE file.
+*/
+
+#ifndef _WORKERS_H_7301
+#define _WORKERS_H_7301
+
+/*	Worker threads, each running its own lua_State, and the mailboxes
+	they use to pass messages to each other.
+	Mailbox 0 belongs to the main thread.
+*/
+
+#if !defined(WIN32) && !defined(WIN64) && !defined(WINNT)
+
+struct lua_State;
+
+/*	Ids of workers and mailboxes, 0 to WORKERS_MAX - 1; shared by the -workers
+	threads and every connection's -lanes threads, so workers * (lanes + 1) must fit.
+*/
+#define WORKERS_MAX 1024
+
+/*	id = worker_start(id, argv | chunk [, path, cpath])
+	Runs the script argv[1] in a new thread with a new lua_State,
+	with the global arg set up from argv the same way lua does, and worker_id = id.
+	Or runs the string chunk of Lua code instead of a script.
+	id can be 0 to use any id not used before, taken from the top so
+	they don't collide with workers started by number.
+	path and cpath set package.path and package.cpath for the new state.
+*/
+int luafunc_worker_start(struct lua_State *L);
+
+/*	true = worker_join(id)
+	Waits for the worker's script to return.
+*/
+int luafunc_worker_join(struct lua_State *L);
+
+/*	fd = worker_mailbox(id)
+	Returns a file descriptor which selects readable when mail is waiting.
+*/
+int luafunc_worker_mailbox(struct lua_State *L);
+
+/*	true = worker_send(to, from, data)
+	data is a string; copied, so any thread can send to any mailbox.
+*/
+int luafunc_worker_send(struct lua_State *L);
+
+/*	messages, senders = worker_receive(id [, max])
+	Returns arrays of the waiting messages and who sent each,
+	or nil if there are none. At most max messages are returned.
+*/
+int luafunc_worker_receive(struct lua_State *L);
+
+
+/*	A pool of threads with their own lua_States for CPU heavy script work.
+	Results are posted to the submitter's mailbox from JOBS_SENDER.
+*/
+
+#define JOBS_MAX_THREADS 32
+#define JOBS_SENDER -1
+
+/*	nthreads = job_pool_start(nthreads [, path, cpath])
+	Starts the pool if not already running; each thread does require("jobs").
+*/
+int luafunc_job_pool_start(struct lua_State *L);
+
+/*	true = job_submit(owner, id, module, func, args)
+	The pool calls jobRun(id, module, func, args) and mails its result to owner.
+*/
+int luafunc_job_submit(struct lua_State *L);
+
+/*	job_pool_stop()
+	Finishes the queued jobs and waits for the threads.
+*/
+int luafunc_job_pool_stop(struct lua_State *L);
+
+#define HAS_WORKERS
+
+#endif
+
+#endif